@@ -0,0 +1,152 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing growable byte buffers used for connection I/O.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+
+#define BUFFER_MIN_SIZE 1024
+
+/**
+ * Initialize empty buffer
+ *
+ * No memory is allocated until data is added.
+ */
+void buffer_init(struct buffer *buf)
+{
+    buf->data = NULL;
+    buf->pos = 0;
+    buf->len = 0;
+    buf->size = 0;
+}
+
+/**
+ * Release memory held by buffer
+ */
+void buffer_free(struct buffer *buf)
+{
+    free(buf->data);
+    buffer_init(buf);
+}
+
+/**
+ * Make sure there is room for at least len bytes at the end of buffer
+ *
+ * Consumed bytes at the front are reclaimed before growing.
+ *
+ * @return 0 on success
+ */
+int buffer_reserve(struct buffer *buf, size_t len)
+{
+    if (buffer_tail_room(buf) >= len)
+        return 0;
+
+    /* reclaim consumed space */
+    if (buf->pos > 0) {
+        memmove(buf->data, buffer_data(buf), buffer_length(buf));
+        buf->len -= buf->pos;
+        buf->pos = 0;
+        if (buffer_tail_room(buf) >= len)
+            return 0;
+    }
+
+    size_t size = buf->size ? buf->size : BUFFER_MIN_SIZE;
+    while (size - buf->len < len)
+        size *= 2;
+
+    char *data = realloc(buf->data, size);
+    if (!data) {
+        log_errno("realloc");
+        return -1;
+    }
+
+    buf->data = data;
+    buf->size = size;
+    return 0;
+}
+
+/**
+ * Append data to buffer
+ *
+ * @return 0 on success
+ */
+int buffer_append(struct buffer *buf, const void *data, size_t len)
+{
+    if (buffer_reserve(buf, len) != 0)
+        return -1;
+
+    memcpy(buffer_tail(buf), data, len);
+    buf->len += len;
+    return 0;
+}
+
+/**
+ * Append string to buffer (without terminating null byte)
+ *
+ * @return 0 on success
+ */
+int buffer_puts(struct buffer *buf, const char *s)
+{
+    return buffer_append(buf, s, strlen(s));
+}
+
+/**
+ * Append formatted string to buffer
+ *
+ * @return 0 on success
+ */
+int buffer_vprintf(struct buffer *buf, const char *format, va_list ap)
+{
+    va_list aq;
+
+    va_copy(aq, ap);
+    int len = vsnprintf(buffer_tail(buf), buffer_tail_room(buf), format, aq);
+    va_end(aq);
+
+    if (len < 0)
+        return -1;
+
+    /* vsnprintf needs room for terminating null byte */
+    if ((size_t) len >= buffer_tail_room(buf)) {
+        if (buffer_reserve(buf, len + 1) != 0)
+            return -1;
+        vsnprintf(buffer_tail(buf), buffer_tail_room(buf), format, ap);
+    }
+
+    buf->len += len;
+    return 0;
+}
+
+/**
+ * Append printf-style formatted string to buffer
+ *
+ * @return 0 on success
+ */
+int buffer_printf(struct buffer *buf, const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    int ret = buffer_vprintf(buf, format, ap);
+    va_end(ap);
+
+    return ret;
+}
+
+/**
+ * Discard len bytes from the front of buffer
+ */
+void buffer_consume(struct buffer *buf, size_t len)
+{
+    buf->pos += len;
+    if (buf->pos >= buf->len)
+        buf->pos = buf->len = 0;
+}
@@ -0,0 +1,52 @@
+#include <stddef.h>
+#include <stdarg.h>
+
+struct buffer {
+    char *data;
+    size_t pos;     /* offset of first unconsumed byte */
+    size_t len;     /* offset one past last byte */
+    size_t size;    /* allocated size */
+};
+
+void buffer_init(struct buffer *buf);
+void buffer_free(struct buffer *buf);
+
+int buffer_reserve(struct buffer *buf, size_t len);
+int buffer_append(struct buffer *buf, const void *data, size_t len);
+int buffer_puts(struct buffer *buf, const char *s);
+int buffer_vprintf(struct buffer *buf, const char *format, va_list ap);
+int buffer_printf(struct buffer *buf, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+void buffer_consume(struct buffer *buf, size_t len);
+
+/**
+ * Pointer to first unconsumed byte
+ */
+static inline char *buffer_data(const struct buffer *buf)
+{
+    return buf->data + buf->pos;
+}
+
+/**
+ * Number of unconsumed bytes
+ */
+static inline size_t buffer_length(const struct buffer *buf)
+{
+    return buf->len - buf->pos;
+}
+
+/**
+ * Pointer to free space at the end of buffer
+ */
+static inline char *buffer_tail(const struct buffer *buf)
+{
+    return buf->data + buf->len;
+}
+
+/**
+ * Amount of free space at the end of buffer
+ */
+static inline size_t buffer_tail_room(const struct buffer *buf)
+{
+    return buf->size - buf->len;
+}
@@ -0,0 +1,179 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing cache of serialized replies.
+ *
+ * Each entry is stamped by the caller with versions of data the reply
+ * was made from. Entry is only returned for the same stamp, so it goes
+ * stale as soon as any of that data changes. Entries may also expire
+ * at a given time, for replies that depend on the clock.
+ *
+ * Compressed form of a body is made when it's first asked for and kept
+ * with the body, so popular replies are compressed only once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "hash.h"
+#include "buffer.h"
+#include "compress.h"
+#include "cache.h"
+
+/* Cache is emptied when it grows beyond this */
+#define CACHE_MAX_ENTRIES   65536
+
+struct cache_entry {
+    struct cache_body *body;
+    int64_t expires;            /* 0 if entry doesn't expire */
+    size_t stamp_len;
+    unsigned char stamp[];
+};
+
+static struct hash_table entries;
+static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void free_entry(void *value)
+{
+    struct cache_entry *entry = value;
+
+    cache_release(entry->body);
+    free(entry);
+}
+
+/**
+ * Look up reply
+ *
+ * @param stamp versions of data reply depends on
+ *
+ * @return body which must be passed to cache_release(),
+ * or NULL if there is no valid entry
+ */
+struct cache_body *cache_get(const char *key, const void *stamp, size_t stamp_len)
+{
+    struct cache_body *body = NULL;
+
+    pthread_rwlock_rdlock(&cache_lock);
+
+    struct cache_entry *entry = hash_get(&entries, key, strlen(key));
+    if (entry && entry->stamp_len == stamp_len &&
+        memcmp(entry->stamp, stamp, stamp_len) == 0 &&
+        (entry->expires == 0 || time(NULL) < entry->expires)) {
+        body = entry->body;
+        __atomic_add_fetch(&body->refs, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_rwlock_unlock(&cache_lock);
+
+    return body;
+}
+
+/**
+ * Store reply, replacing previous one with the same key
+ *
+ * @param expires time after which reply is stale, 0 if never
+ *
+ * @return stored body which must be passed to cache_release(),
+ * or NULL if there was no memory for it
+ */
+struct cache_body *cache_put(const char *key, const void *stamp, size_t stamp_len, int64_t expires,
+                             const char *data, size_t len)
+{
+    struct cache_entry *entry = malloc(sizeof(*entry) + stamp_len);
+    struct cache_body *body = malloc(sizeof(*body) + len);
+    if (!entry || !body) {
+        /* Replies are still sent, they're just not cached */
+        free(entry);
+        free(body);
+        return NULL;
+    }
+
+    /* one reference for cache, one for caller */
+    body->refs = 2;
+    body->len = len;
+    body->deflated = NULL;
+    memcpy(body->data, data, len);
+    entry->body = body;
+    entry->expires = expires;
+    entry->stamp_len = stamp_len;
+    memcpy(entry->stamp, stamp, stamp_len);
+
+    pthread_rwlock_wrlock(&cache_lock);
+
+    if (entries.count >= CACHE_MAX_ENTRIES) {
+        hash_free_all(&entries, free_entry);
+    }
+
+    struct cache_entry *old = hash_remove(&entries, key, strlen(key));
+    if (old)
+        free_entry(old);
+    if (hash_put(&entries, key, strlen(key), entry) != 0)
+        free_entry(entry);
+
+    pthread_rwlock_unlock(&cache_lock);
+
+    return body;
+}
+
+/**
+ * Get compressed form of body
+ *
+ * @return body which must be passed to cache_release(),
+ * or NULL on error
+ */
+struct cache_body *cache_deflated(struct cache_body *body)
+{
+    struct cache_body *deflated = __atomic_load_n(&body->deflated, __ATOMIC_ACQUIRE);
+
+    if (!deflated) {
+        struct buffer buf;
+        buffer_init(&buf);
+
+        if (deflate_data(body->data, body->len, &buf) != 0) {
+            buffer_free(&buf);
+            return NULL;
+        }
+
+        deflated = malloc(sizeof(*deflated) + buffer_length(&buf));
+        if (!deflated) {
+            log_errno("malloc");
+            buffer_free(&buf);
+            return NULL;
+        }
+
+        deflated->refs = 1;
+        deflated->len = buffer_length(&buf);
+        deflated->deflated = NULL;
+        memcpy(deflated->data, buffer_data(&buf), deflated->len);
+        buffer_free(&buf);
+
+        /* Another thread may have been first */
+        struct cache_body *expected = NULL;
+        if (!__atomic_compare_exchange_n(&body->deflated, &expected, deflated, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(deflated);
+            deflated = expected;
+        }
+    }
+
+    __atomic_add_fetch(&deflated->refs, 1, __ATOMIC_RELAXED);
+    return deflated;
+}
+
+/**
+ * Release body returned by cache_get(), cache_put() or cache_deflated()
+ */
+void cache_release(struct cache_body *body)
+{
+    if (__atomic_sub_fetch(&body->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (body->deflated)
+            cache_release(body->deflated);
+        free(body);
+    }
+}
@@ -0,0 +1,18 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Serialized reply shared by cache and its readers
+ */
+struct cache_body {
+    int refs;
+    size_t len;
+    struct cache_body *deflated;    /* compressed form, made on first use */
+    char data[];
+};
+
+struct cache_body *cache_get(const char *key, const void *stamp, size_t stamp_len);
+struct cache_body *cache_put(const char *key, const void *stamp, size_t stamp_len, int64_t expires,
+                             const char *data, size_t len);
+struct cache_body *cache_deflated(struct cache_body *body);
+void cache_release(struct cache_body *body);
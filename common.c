@@ -6,21 +6,374 @@
  * Module for code shared between other modules.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "common.h"
 
-static void log_msg_real(char *format, va_list ap)
+/* Longer messages are truncated */
+#define LOG_LINE_MAX    1024
+/* Bytes of messages a thread may have waiting to be written */
+#define LOG_RING_SIZE   (64 * 1024)
+#define LOG_TAG_MAX     128
+/* Bytes written to stderr at once */
+#define LOG_WRITE_CHUNK (64 * 1024)
+
+/**
+ * Messages of a single thread waiting to be written
+ *
+ * Only the thread appends at head and only the one draining rings
+ * takes from tail, so neither waits for the other. Each message is
+ * stored as its length followed by its text, wrapping around the end
+ * of data.
+ */
+struct log_ring {
+    uint64_t head;              /* bytes ever appended */
+    uint64_t tail;              /* bytes ever taken */
+    uint64_t dropped;           /* messages that didn't fit */
+    struct log_ring *next;
+    char data[LOG_RING_SIZE];
+};
+
+static const char *const level_names[] = {
+    [LOG_LEVEL_ERROR] = "ERROR",
+    [LOG_LEVEL_WARNING] = "WARNING",
+    [LOG_LEVEL_INFO] = "INFO",
+    [LOG_LEVEL_DEBUG] = "DEBUG"
+};
+
+static int log_level = LOG_LEVEL_INFO;
+
+/* Rings of all threads that have logged, never freed */
+static struct log_ring *rings;
+static __thread struct log_ring *thread_ring;
+static __thread char thread_tag[LOG_TAG_MAX];
+/* Messages of threads that couldn't get a ring */
+static uint64_t ringless_dropped;
+
+/* Until writer thread is started, messages are written right away */
+static int started;
+static int wakeup_fd = -1;
+static int writer_sleeping;
+/* Held by whoever drains rings */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void write_all(const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, data, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return;
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * Format message line with timestamp, level and tag of thread
+ *
+ * @return length of line, which always ends with newline
+ */
+static size_t format_line(char *line, int level, const char *format, va_list ap)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    int n = snprintf(line, LOG_LINE_MAX, "[%6ld.%06ld] %s %s%s", (long) ts.tv_sec,
+                     ts.tv_nsec / 1000, level_names[level], thread_tag, thread_tag[0] ? ": " : "");
+    if (n < 0)
+        n = 0;
+    if (n > LOG_LINE_MAX - 1)
+        n = LOG_LINE_MAX - 1;
+
+    int m = vsnprintf(line + n, LOG_LINE_MAX - n, format, ap);
+    size_t len = n + (m > 0 ? m : 0);
+    if (len > LOG_LINE_MAX - 1)
+        len = LOG_LINE_MAX - 1;
+
+    if (len == 0 || line[len - 1] != '\n') {
+        if (len == LOG_LINE_MAX - 1)
+            len--;
+        line[len++] = '\n';
+    }
+
+    return len;
+}
+
+static struct log_ring *get_ring(void)
+{
+    if (thread_ring)
+        return thread_ring;
+
+    struct log_ring *ring = malloc(sizeof(*ring));
+    if (!ring)
+        return NULL;
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+    ring->next = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+
+    thread_ring = ring;
+    return ring;
+}
+
+static void ring_copy_in(struct log_ring *ring, uint64_t pos, const void *src, size_t len)
+{
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+
+    memcpy(ring->data + off, src, first);
+    memcpy(ring->data, (const char *) src + first, len - first);
+}
+
+static void ring_copy_out(const struct log_ring *ring, uint64_t pos, void *dst, size_t len)
+{
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+
+    memcpy(dst, ring->data + off, first);
+    memcpy((char *) dst + first, ring->data, len - first);
+}
+
+/**
+ * Queue line for writer thread, dropping it if thread's ring is full
+ */
+static void queue_line(const char *line, uint32_t len)
+{
+    struct log_ring *ring = get_ring();
+    if (!ring) {
+        __atomic_add_fetch(&ringless_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail + sizeof(len) + len > LOG_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ring_copy_in(ring, head, &len, sizeof(len));
+    ring_copy_in(ring, head + sizeof(len), line, len);
+    __atomic_store_n(&ring->head, head + sizeof(len) + len, __ATOMIC_RELEASE);
+
+    /* Pairs with the fence in writer_main() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(wakeup_fd, &one, sizeof(one)) == -1) {
+            /* counter can't overflow, writer is awake anyway */
+        }
+    }
+}
+
+/**
+ * Write out messages of all threads
+ *
+ * @return number of bytes written
+ */
+static size_t drain_rings(void)
+{
+    static char out[LOG_WRITE_CHUNK + LOG_LINE_MAX];
+    size_t total = 0;
+    size_t n = 0;
+
+    pthread_mutex_lock(&drain_lock);
+
+    for (struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint64_t tail = ring->tail;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        while (tail < head) {
+            uint32_t len;
+            ring_copy_out(ring, tail, &len, sizeof(len));
+            ring_copy_out(ring, tail + sizeof(len), out + n, len);
+            tail += sizeof(len) + len;
+            n += len;
+
+            /* Make room in ring before writing */
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            if (n >= LOG_WRITE_CHUNK) {
+                write_all(out, n);
+                total += n;
+                n = 0;
+            }
+        }
+
+        uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0)
+            n += snprintf(out + n, LOG_LINE_MAX, "%" PRIu64 " log messages dropped\n", dropped);
+        if (n >= LOG_WRITE_CHUNK) {
+            write_all(out, n);
+            total += n;
+            n = 0;
+        }
+    }
+
+    uint64_t dropped = __atomic_exchange_n(&ringless_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0)
+        n += snprintf(out + n, LOG_LINE_MAX, "%" PRIu64 " log messages dropped\n", dropped);
+
+    write_all(out, n);
+    total += n;
+
+    pthread_mutex_unlock(&drain_lock);
+
+    return total;
+}
+
+static int rings_pending(void)
+{
+    for (struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != __atomic_load_n(&ring->tail, __ATOMIC_RELAXED))
+            return 1;
+
+    return 0;
+}
+
+static void *writer_main(void *arg)
+{
+    for (;;) {
+        if (drain_rings() > 0)
+            continue;
+
+        __atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (rings_pending()) {
+            __atomic_store_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        struct pollfd pfd = { .fd = wakeup_fd, .events = POLLIN };
+        uint64_t count;
+        if (poll(&pfd, 1, -1) == 1 && read(wakeup_fd, &count, sizeof(count)) == -1) {
+            /* nothing to do, rings are checked anyway */
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Write out all messages logged so far
+ */
+void log_flush(void)
+{
+    if (started)
+        drain_rings();
+}
+
+/**
+ * Start writing messages from background thread
+ *
+ * From now on logging never waits for stderr. Messages that don't fit
+ * in thread's ring are dropped and counted. Pending messages are
+ * written at exit.
+ *
+ * @return 0 on success
+ */
+int log_start(void)
+{
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd == -1) {
+        log_errno("eventfd");
+        return -1;
+    }
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, writer_main, NULL);
+    if (ret != 0) {
+        log_msg("pthread_create: %s\n", strerror(ret));
+        close(wakeup_fd);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    started = 1;
+    atexit(log_flush);
+
+    return 0;
+}
+
+/**
+ * Set least important level of messages which are logged
+ */
+void log_set_level(int level)
+{
+    log_level = level;
+}
+
+/**
+ * Check if messages of level are logged
+ */
+int log_enabled(int level)
 {
-    vfprintf(stderr, format, ap);
+    return level <= log_level;
+}
+
+/**
+ * Tag messages logged by calling thread
+ *
+ * @param peer address of peer being served, NULL to clear tag
+ * @param user name of user being served, NULL if unknown
+ */
+void log_set_tag(const char *peer, const char *user)
+{
+    if (!peer)
+        thread_tag[0] = '\0';
+    else
+        snprintf(thread_tag, sizeof(thread_tag), "%s%s%s", peer, user ? " " : "", user ? user : "");
+}
+
+static void log_msg_real(int level, char *format, va_list ap)
+{
+    char line[LOG_LINE_MAX];
+
+    if (!log_enabled(level))
+        return;
+
+    size_t len = format_line(line, level, format, ap);
+    if (started)
+        queue_line(line, len);
+    else
+        write_all(line, len);
 }
 
 /**
- * Log a message.
+ * Log a message of given importance.
+ *
+ * Takes a printf-style format string with zero or more arguments.
+ *
+ * @param level one of LOG_LEVEL_*
+ * @param format format string
+ */
+void log_msg_at(int level, char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    log_msg_real(level, format, ap);
+    va_end(ap);
+}
+
+/**
+ * Log an error message.
  *
  * Takes a printf-style format string with zero or more arguments.
  * 
@@ -30,7 +383,7 @@ void log_msg(char *format, ...)
 {
     va_list ap;
     va_start(ap, format);
-    log_msg_real(format, ap);
+    log_msg_real(LOG_LEVEL_ERROR, format, ap);
     va_end(ap);
 }
 
@@ -38,15 +391,21 @@ void log_msg(char *format, ...)
  * Log a message and terminate server.
  *
  * Takes a printf-style format string with zero or more arguments.
+ * Messages logged before are written first.
  *
  * @param format format string
  */
 void log_msg_die(char *format, ...)
 {
+    char line[LOG_LINE_MAX];
     va_list ap;
+
+    log_flush();
+
     va_start(ap, format);
-    log_msg_real(format, ap);
+    size_t len = format_line(line, LOG_LEVEL_ERROR, format, ap);
     va_end(ap);
+    write_all(line, len);
 
     exit(EXIT_FAILURE);
 }
@@ -56,7 +415,7 @@ void log_msg_die(char *format, ...)
  *
  * @param s Informational string for user.
  */
-void log_errno(char *s)
+void log_errno(const char *s)
 {
     log_msg("%s: %s\n", s, strerror(errno));
 }
@@ -67,7 +426,7 @@ void log_errno(char *s)
  *
  * @param s Informational string for user.
  */
-void log_errno_die(char *s)
+void log_errno_die(const char *s)
 {
     log_msg_die("%s: %s\n", s, strerror(errno));
 }
@@ -1,11 +1,32 @@
 #include <assert.h>
+#include <stddef.h>
+
+/* Get pointer to structure from pointer to its member */
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+/* Importance of log messages, the most important first */
+enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+int log_start(void);
+void log_flush(void);
+void log_set_level(int level);
+int log_enabled(int level);
+void log_set_tag(const char *peer, const char *user);
+
+void log_msg_at(int level, char *format, ...) __attribute__ ((format (printf, 2, 3)));
 
 void log_msg(char *format, ...) __attribute__ ((format (printf, 1, 2)));
 
 void log_msg_die(char *format, ...) __attribute__ ((format (printf, 1, 2))); 
 
-void log_errno(char *s);
+void log_errno(const char *s);
 
-void log_errno_die(char *s);
+void log_errno_die(const char *s);
 
 int streq(const char *a, const char *b);
@@ -0,0 +1,94 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing compression of replies and request bodies.
+ *
+ * Data is compressed as a zlib stream (RFC 1950).
+ */
+
+#include <stdio.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "compress.h"
+
+#define INFLATE_CHUNK   (16 * 1024)
+
+/**
+ * Compress data, appending result to buffer
+ *
+ * @return 0 on success, -1 on error
+ */
+int deflate_data(const void *data, size_t len, struct buffer *out)
+{
+    uLong bound = compressBound(len);
+    if (buffer_reserve(out, bound) != 0)
+        return -1;
+
+    uLongf dest_len = bound;
+    int ret = compress2((Bytef *) buffer_tail(out), &dest_len, data, len, Z_DEFAULT_COMPRESSION);
+    if (ret != Z_OK) {
+        log_msg("compress2: %s\n", zError(ret));
+        return -1;
+    }
+
+    out->len += dest_len;
+    return 0;
+}
+
+/**
+ * Decompress data a chunk at a time
+ *
+ * @param sink called with each chunk of decompressed data, returns
+ * 0 to continue, 1 to stop or -1 on error
+ *
+ * @return 1 if stopped by sink, 0 if all data was decompressed,
+ * -1 if data is invalid or sink failed
+ */
+int inflate_data(const void *data, size_t len,
+                 int (*sink)(const char *chunk, size_t len, void *arg), void *arg)
+{
+    z_stream zs = {0};
+    char chunk[INFLATE_CHUNK];
+    int ret;
+
+    if (len != (uInt) len)
+        return -1;
+
+    if (inflateInit(&zs) != Z_OK) {
+        log_msg("inflateInit: %s\n", zs.msg ? zs.msg : "error");
+        return -1;
+    }
+
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = len;
+
+    for (;;) {
+        zs.next_out = (Bytef *) chunk;
+        zs.avail_out = sizeof(chunk);
+
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            ret = -1;
+            break;
+        }
+
+        int done = ret == Z_STREAM_END;
+        ret = sink(chunk, sizeof(chunk) - zs.avail_out, arg);
+        if (ret != 0)
+            break;
+        if (done)
+            break;
+        if (zs.avail_in == 0 && zs.avail_out != 0) {
+            /* truncated stream */
+            ret = -1;
+            break;
+        }
+    }
+
+    inflateEnd(&zs);
+    return ret;
+}
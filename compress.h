@@ -0,0 +1,7 @@
+#include <stddef.h>
+
+struct buffer;
+
+int deflate_data(const void *data, size_t len, struct buffer *out);
+int inflate_data(const void *data, size_t len,
+                 int (*sink)(const char *chunk, size_t len, void *arg), void *arg);
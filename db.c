@@ -8,27 +8,175 @@
  
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <json-c/json.h>
 #include <uuid/uuid.h>
 #include <stdbool.h>
 
 #include "common.h"
+#include "hash.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "buffer.h"
+#include "image.h"
+#include "grade.h"
+#include "selection.h"
+#include "stats.h"
 #include "db.h"
 
 #define TESTS_FILENAME      "tests"
 #define ANSWERS_FILENAME    "answers"
 #define USERS_FILENAME      "users"
 #define GROUPS_FILENAME     "groups"
+#define IMAGE_FILENAME      "db.image"
+#define ANSWERS_JOURNAL_FILENAME    "answers.journal"
+/* One file per test, named by test id */
+#define ANSWERS_DIRNAME     "answers.d"
+/* Single answers file is renamed once split into shards */
+#define MIGRATED_SUFFIX     ".migrated"
 
 #define JSON_FLAGS          (JSON_C_TO_STRING_PRETTY | JSON_C_TO_STRING_SPACED)
+#define VIEW_FLAGS          JSON_C_TO_STRING_PLAIN
 
+/* Only read at startup, written through snapshots. Answers file
+ * is optional, it's only read to migrate it to answer shards. */
 static FILE *tests_file;
 static FILE *answers_file;
 static FILE *users_file;
 static FILE *groups_file;
 
+static struct snapshot tests_snapshot;
+static struct snapshot groups_snapshot;
+
+/* Binary image of tests, users and groups for fast startup */
+static struct snapshot image_snapshot;
+/* Copies of collections and fingerprints of database files as last
+ * written, image is built from them. Owned by snapshot writer thread
+ * once database is loaded. */
+static json_object *image_collections[IMAGE_NCOLLECTIONS];
+static struct image_source image_sources[IMAGE_NCOLLECTIONS];
+
+/* Changes to answers since shards were written */
+static struct journal answers_journal;
+
+/* Resident copies of database files, these are the source of truth
+ * while server runs. Files are only written to. */
+static json_object *tests_db;
+static json_object *users_db;
+static json_object *groups_db;
+
+/**
+ * Answers to a single test, kept in its own file
+ *
+ * Shards are only loaded when needed, so answers to tests
+ * nobody has asked about since startup stay on disk.
+ */
+struct answers_shard {
+    uuid_t test_id;
+    json_object *record;        /* test answers record, NULL until loaded */
+    int broken;                 /* file couldn't be loaded */
+    int dirty;                  /* differs from file, only used at startup */
+    struct answers_shard *next;
+};
+
+static char *answers_dir;
+static struct answers_shard *answers_shards;
+/* Shards are loaded by readers too, this serializes loading */
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Indexes of resident database */
+static struct hash_table tests_by_id;           /* uuid_t -> test */
+static struct hash_table answers_by_test_id;    /* uuid_t -> answers shard */
+static struct hash_table users_by_name;         /* name -> user */
+
+/* Positions of tests in tests database */
+struct test_list {
+    int *idx;
+    size_t len;
+    size_t size;
+};
+
+/**
+ * Indexes derived from groups database
+ *
+ * Groups are identified by their position in groups database.
+ * Rebuilt as a whole when groups are replaced.
+ */
+struct groups_index {
+    struct hash_table by_name;      /* name -> group id + 1 */
+    struct hash_table members;      /* username -> bitset of group ids */
+    struct test_list *tests;        /* group id -> tests given to group */
+    size_t ngroups;
+    size_t nwords;                  /* length of member bitsets */
+};
+
+static struct groups_index groups_index;
+
+/**
+ * Serialized views of a test, never modified once built
+ */
+struct test_views {
+    uuid_t id;
+    int has_id;
+    char *summary;              /* without questions and correct answers */
+    size_t summary_len;
+    char *student;              /* without correct answers */
+    size_t student_len;
+    char *results;              /* whole test */
+    size_t results_len;
+
+    int has_times;              /* times and resultsAvailable below are valid */
+    int64_t start_time;
+    int64_t end_time;
+    int results_available;
+};
+
+/* Views of tests, in the same order as tests database */
+static struct test_views **test_views;
+static size_t ntest_views;
+static size_t test_views_size;
+static struct hash_table views_by_id;           /* uuid_t -> test views */
+
+/* Versions of database parts, so that replies made from them can be cached */
+static uint64_t tests_version;
+static uint64_t groups_version;
+static struct hash_table answers_versions;      /* username -> version of user's answers */
+
+/* Readers of database may run concurrently, writers are serialized */
+static pthread_rwlock_t db_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Scores of submissions graded so far. Neither tests nor submitted
+ * answers ever change, so neither do their scores. */
+static struct hash_table grades;                /* test id + username -> grade */
+/* Grades are added by readers of database */
+static pthread_mutex_t grades_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Item statistics of tests, made on first request and then kept up to
+ * date by submit_answers(). */
+static struct hash_table stats_by_test_id;      /* uuid_t -> test stats */
+/* Statistics are made by readers of database */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int load_db(void);
+static int load_answers(void);
+static int add_test_views(json_object *test);
+static int load_image(const struct image *image);
+static int write_json_file(const char *path, json_object *obj);
+static json_object *deep_copy(json_object *obj);
+static int render_tests(void *obj, struct buffer *out);
+static int render_groups(void *obj, struct buffer *out);
+static void release_json(void *obj);
+static int apply_answers_event(json_object *event);
+static void free_groups_index(struct groups_index *gi);
+bool is_array_of_json_type(json_object *obj, json_type type);
+
 /**
  * Open database files
  *
@@ -38,53 +186,146 @@ static FILE *groups_file;
  */
 int open_db(const char *db_dir)
 {
-    int ret = 0;
+    int ret = -1;
     char *tests_filename, *answers_filename,
-         *users_filename, *groups_filename;
+         *users_filename, *groups_filename,
+         *answers_journal_filename, *image_filename;
 
     /* no error checking */
     asprintf(&tests_filename, "%s/%s", db_dir, TESTS_FILENAME);
     asprintf(&answers_filename, "%s/%s", db_dir, ANSWERS_FILENAME);
     asprintf(&users_filename, "%s/%s", db_dir, USERS_FILENAME);
     asprintf(&groups_filename, "%s/%s", db_dir, GROUPS_FILENAME);
+    asprintf(&answers_journal_filename, "%s/%s", db_dir, ANSWERS_JOURNAL_FILENAME);
+    asprintf(&answers_dir, "%s/%s", db_dir, ANSWERS_DIRNAME);
+    asprintf(&image_filename, "%s/%s", db_dir, IMAGE_FILENAME);
 
-    tests_file = fopen(tests_filename, "r+");
+    tests_file = fopen(tests_filename, "r");
     if (!tests_file) {
         log_errno(tests_filename);
         goto err_tests;
     }
-    answers_file = fopen(answers_filename, "r+");
-    if (!answers_file) {
+    answers_file = fopen(answers_filename, "r");
+    if (!answers_file && errno != ENOENT) {
         log_errno(answers_filename);
         goto err_answers;
     }
-    users_file = fopen(users_filename, "r+");
+    users_file = fopen(users_filename, "r");
     if (!users_file) {
         log_errno(users_filename);
         goto err_users;
     }
-    groups_file = fopen(groups_filename, "r+");
+    groups_file = fopen(groups_filename, "r");
     if (!groups_file) {
         log_errno(groups_filename);
         goto err_groups;
     }
 
-    goto out;
+    if (snapshot_init(&tests_snapshot, tests_filename) != 0 ||
+        snapshot_init(&groups_snapshot, groups_filename) != 0 ||
+        snapshot_init(&image_snapshot, image_filename) != 0 ||
+        snapshot_start_writer() != 0)
+        goto close_files;
+    /* Image is only a cache, stale image is rejected by its fingerprints */
+    image_snapshot.fatal = 0;
+    tests_snapshot.render = render_tests;
+    tests_snapshot.release = release_json;
+    groups_snapshot.render = render_groups;
+    groups_snapshot.release = release_json;
+
+    if (journal_open(&answers_journal, answers_journal_filename) != 0)
+        goto close_files;
+
+    if (load_db() != 0 || journal_start_committer(&answers_journal) != 0) {
+        journal_close(&answers_journal);
+        goto close_files;
+    }
+
+    /* Answers file has been split into shards */
+    if (answers_file) {
+        char *migrated_filename;
+        asprintf(&migrated_filename, "%s%s", answers_filename, MIGRATED_SUFFIX);
+        if (rename(answers_filename, migrated_filename) == -1)
+            log_errno(answers_filename);
+        free(migrated_filename);
+    }
+
+    ret = 0;
 
-/* stack unwind cleanup */
+/* stack unwind cleanup, files are not needed once loaded */
+close_files:
+    fclose(groups_file);
 err_groups:
     fclose(users_file);
 err_users:
-    fclose(answers_file);
+    if (answers_file)
+        fclose(answers_file);
 err_answers:
     fclose(tests_file);
 err_tests:
-    ret = -1;
-out:
     free(tests_filename);
     free(answers_filename);
     free(users_filename);
     free(groups_filename);
+    free(answers_journal_filename);
+    free(image_filename);
+
+    return ret;
+}
+
+/**
+ * Write database files from database image
+ *
+ * Image is used even if it doesn't match database files,
+ * which are replaced.
+ *
+ * @param db_dir directory where database is located
+ *
+ * @return 0 on success
+ */
+int export_db_image(const char *db_dir)
+{
+    static const char *filenames[IMAGE_NCOLLECTIONS] = {
+        [IMAGE_TESTS] = TESTS_FILENAME,
+        [IMAGE_USERS] = USERS_FILENAME,
+        [IMAGE_GROUPS] = GROUPS_FILENAME
+    };
+    char *image_filename;
+    struct image image;
+    int ret = -1;
+
+    /* no error checking */
+    asprintf(&image_filename, "%s/%s", db_dir, IMAGE_FILENAME);
+
+    if (image_open(&image, image_filename) != 0) {
+        log_msg("%s: no usable database image\n", image_filename);
+        goto out;
+    }
+    ret = load_image(&image);
+    image_close(&image);
+    if (ret != 0)
+        goto out;
+
+    json_object *collections[IMAGE_NCOLLECTIONS] = {
+        [IMAGE_TESTS] = tests_db,
+        [IMAGE_USERS] = users_db,
+        [IMAGE_GROUPS] = groups_db
+    };
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++) {
+        char *filename;
+        asprintf(&filename, "%s/%s", db_dir, filenames[c]);
+        if (write_json_file(filename, collections[c]) != 0)
+            ret = -1;
+        free(filename);
+    }
+
+    hash_free(&tests_by_id);
+    json_object_put(tests_db);
+    json_object_put(users_db);
+    json_object_put(groups_db);
+
+out:
+    free(image_filename);
 
     return ret;
 }
@@ -94,10 +335,43 @@ out:
  */
 void close_db(void)
 {
-    fclose(tests_file);
-    fclose(answers_file);
-    fclose(users_file);
-    fclose(groups_file);
+    hash_free(&tests_by_id);
+    hash_free(&answers_by_test_id);
+    hash_free(&users_by_name);
+    hash_free_all(&answers_versions, free);
+    hash_free_all(&grades, free);
+    hash_free_all(&stats_by_test_id, (void (*)(void *)) stats_free);
+    hash_free(&views_by_id);
+    for (size_t i = 0; i < ntest_views; i++) {
+        free(test_views[i]->summary);
+        free(test_views[i]->student);
+        free(test_views[i]->results);
+        free(test_views[i]);
+    }
+    free(test_views);
+    free_groups_index(&groups_index);
+
+    json_object_put(tests_db);
+    json_object_put(users_db);
+    json_object_put(groups_db);
+
+    while (answers_shards) {
+        struct answers_shard *shard = answers_shards;
+        answers_shards = shard->next;
+        json_object_put(shard->record);
+        free(shard);
+    }
+    free(answers_dir);
+
+    snapshot_flush();
+    snapshot_destroy(&tests_snapshot);
+    snapshot_destroy(&groups_snapshot);
+    snapshot_destroy(&image_snapshot);
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++) {
+        json_object_put(image_collections[c]);
+        image_collections[c] = NULL;
+    }
+    journal_close(&answers_journal);
 }
 
 /**
@@ -141,7 +415,6 @@ static char *file_to_string(FILE *fp)
     return buf;
 }
 
-
 /**
  * Get JSON object from file
  *
@@ -167,180 +440,946 @@ static json_object *get_json_from_file(FILE *fp)
 }
 
 /**
- * Get json_object containing users database
+ * Get uuid from JSON object key holding its string representation
+ * 
+ * @param obj json_object of type json_type_object
+ *
+ * @return 1 if key holds valid uuid
  */
-json_object *get_users(void)
+static int key_value_to_uuid(json_object *obj, const char *key, uuid_t uuid)
 {
-    return get_json_from_file(users_file);
+    json_object *value;
+    if (json_object_object_get_ex(obj, key, &value) == TRUE)
+        if (json_object_is_type(value, json_type_string))
+            if (uuid_parse(json_object_get_string(value), uuid) == 0)
+                return 1;
+    return 0;
 }
 
 /**
- * Get json_object containing groups database
+ * Index elements of JSON array by uuid held in their key
+ *
+ * If uuid is repeated the first element is indexed.
+ *
+ * @return 0 on success
  */
-json_object *get_groups(void)
+static int index_by_uuid(struct hash_table *index, json_object *array, const char *key)
 {
-    return get_json_from_file(groups_file);
+    for (int i = 0; i < json_object_array_length(array); i++) {
+        json_object *obj = json_object_array_get_idx(array, i);
+        uuid_t id;
+        if (key_value_to_uuid(obj, key, id) && !hash_get(index, id, sizeof(uuid_t)))
+            if (hash_put(index, id, sizeof(uuid_t), obj) != 0)
+                return -1;
+    }
+
+    return 0;
 }
 
 /**
- * Get json_object containing tests database
+ * Index entities (users or groups) by their name
+ *
+ * If name is repeated the first entity is indexed.
+ *
+ * @return 0 on success
  */
-json_object *get_tests(void)
+static int index_by_name(struct hash_table *index, json_object *entities)
+{
+    for (int i = 0; i < json_object_array_length(entities); i++) {
+        json_object *entity = json_object_array_get_idx(entities, i);
+        json_object *value;
+        if (json_object_object_get_ex(entity, "name", &value) != TRUE ||
+            !json_object_is_type(value, json_type_string))
+            continue;
+        const char *name = json_object_get_string(value);
+        if (!hash_get(index, name, strlen(name)))
+            if (hash_put(index, name, strlen(name), entity) != 0)
+                return -1;
+    }
+
+    return 0;
+}
+
+static int test_list_add(struct test_list *list, int idx)
 {
-    return get_json_from_file(tests_file);
+    /* test may list the same group twice */
+    if (list->len > 0 && list->idx[list->len - 1] == idx)
+        return 0;
+
+    if (list->len == list->size) {
+        size_t size = list->size ? list->size * 2 : 8;
+        int *p = realloc(list->idx, size * sizeof(*p));
+        if (!p) {
+            log_errno("realloc");
+            return -1;
+        }
+        list->idx = p;
+        list->size = size;
+    }
+
+    list->idx[list->len++] = idx;
+    return 0;
 }
 
 /**
- * Get json_object containing answers database
+ * Get id of group or -1 if there is no such group
  */
-json_object *get_answers(void)
+static int get_group_id(const struct groups_index *gi, const char *name)
 {
-    json_object *answers = get_json_from_file(answers_file);
+    intptr_t id = (intptr_t) hash_get(&gi->by_name, name, strlen(name));
 
-    if (!answers)
-        return json_object_new_array();
-    return answers;
+    return id - 1;
 }
 
 /**
- * Write JSON data to file
+ * Add test at position idx of tests database to lists of its groups
  *
- * @param obj JSON data
- * @param file stream opened for writing
+ * @return 0 on success
  */
-static void put_json_to_file(json_object *obj, FILE *fp)
+static int groups_index_add_test(struct groups_index *gi, json_object *test, int idx)
 {
-    fseek(fp, 0, SEEK_SET);
-    fputs(json_object_to_json_string_ext(obj, JSON_FLAGS), fp);
-    fflush(fp);
-    ftruncate(fileno(fp), ftello(fp));
+    json_object *test_groups;
+    if (json_object_object_get_ex(test, "groups", &test_groups) != TRUE)
+        return 0;
+
+    for (int i = 0; i < json_object_array_length(test_groups); i++) {
+        json_object *test_group = json_object_array_get_idx(test_groups, i);
+        if (!json_object_is_type(test_group, json_type_string))
+            continue;
+        int id = get_group_id(gi, json_object_get_string(test_group));
+        if (id >= 0 && test_list_add(&gi->tests[id], idx) != 0)
+            return -1;
+    }
+
+    return 0;
+}
 
-    if (ferror(fp))
-        log_msg_die("Database write error");
+static void free_groups_index(struct groups_index *gi)
+{
+    hash_free(&gi->by_name);
+    hash_free_all(&gi->members, free);
+    for (size_t i = 0; i < gi->ngroups; i++)
+        free(gi->tests[i].idx);
+    free(gi->tests);
+    gi->tests = NULL;
+    gi->ngroups = 0;
 }
 
 /**
- * Write json_object to answers database
+ * Build group indexes
+ *
+ * If group name is repeated the first group is indexed.
+ *
+ * @return 0 on success
  */
-void put_answers(json_object *answers)
+static int build_groups_index(struct groups_index *gi, json_object *groups, json_object *tests)
 {
-    put_json_to_file(answers, answers_file);
+    hash_init(&gi->by_name);
+    hash_init(&gi->members);
+    gi->ngroups = json_object_array_length(groups);
+    gi->nwords = (gi->ngroups + 63) / 64;
+    gi->tests = calloc(gi->ngroups, sizeof(*gi->tests));
+    if (gi->ngroups > 0 && !gi->tests) {
+        log_errno("calloc");
+        goto err;
+    }
+
+    for (int id = 0; id < gi->ngroups; id++) {
+        json_object *group = json_object_array_get_idx(groups, id);
+        json_object *value;
+        if (json_object_object_get_ex(group, "name", &value) != TRUE ||
+            !json_object_is_type(value, json_type_string))
+            continue;
+        const char *name = json_object_get_string(value);
+        if (hash_get(&gi->by_name, name, strlen(name)))
+            continue;
+        if (hash_put(&gi->by_name, name, strlen(name), (void *) (intptr_t) (id + 1)) != 0)
+            goto err;
+
+        json_object *members;
+        if (json_object_object_get_ex(group, "members", &members) != TRUE)
+            continue;
+        for (int i = 0; i < json_object_array_length(members); i++) {
+            json_object *member = json_object_array_get_idx(members, i);
+            if (!json_object_is_type(member, json_type_string))
+                continue;
+            const char *username = json_object_get_string(member);
+            uint64_t *bits = hash_get(&gi->members, username, strlen(username));
+            if (!bits) {
+                bits = calloc(gi->nwords, sizeof(*bits));
+                if (!bits) {
+                    log_errno("calloc");
+                    goto err;
+                }
+                if (hash_put(&gi->members, username, strlen(username), bits) != 0) {
+                    free(bits);
+                    goto err;
+                }
+            }
+            bits[id / 64] |= UINT64_C(1) << (id % 64);
+        }
+    }
+
+    for (int i = 0; i < json_object_array_length(tests); i++)
+        if (groups_index_add_test(gi, json_object_array_get_idx(tests, i), i) != 0)
+            goto err;
+
+    return 0;
+
+err:
+    free_groups_index(gi);
+    return -1;
 }
 
 /**
- * Write json_object to tests database
+ * Check membership using groups index
  */
-void put_tests(json_object *tests)
+static int groups_index_is_member(const struct groups_index *gi, const char *username, int id)
+{
+    if (id < 0)
+        return 0;
+
+    uint64_t *bits = hash_get(&gi->members, username, strlen(username));
+
+    return bits && (bits[id / 64] & (UINT64_C(1) << (id % 64)));
+}
+
+static int compare_int(const void *a, const void *b)
 {
-    put_json_to_file(tests, tests_file);
+    int x = *(const int *) a, y = *(const int *) b;
+
+    return (x > y) - (x < y);
 }
 
 /**
- * Write json_object to groups database
+ * Get positions of tests given to any of user's groups
+ *
+ * Unions test lists of groups in user's bitset.
+ *
+ * @param len set to number of tests
+ *
+ * @return sorted array of positions (to be freed by caller)
+ * or NULL if there are none
  */
-void put_groups(json_object *groups)
+static int *groups_index_user_tests(const struct groups_index *gi, const char *username, size_t *len)
 {
-    put_json_to_file(groups, groups_file);
+    *len = 0;
+
+    uint64_t *bits = hash_get(&gi->members, username, strlen(username));
+    if (!bits)
+        return NULL;
+
+    size_t total = 0;
+    for (size_t w = 0; w < gi->nwords; w++)
+        for (uint64_t word = bits[w]; word; word &= word - 1)
+            total += gi->tests[w * 64 + __builtin_ctzll(word)].len;
+    if (total == 0)
+        return NULL;
+
+    int *idx = malloc(total * sizeof(*idx));
+    if (!idx) {
+        log_errno("malloc");
+        return NULL;
+    }
+
+    size_t n = 0;
+    for (size_t w = 0; w < gi->nwords; w++)
+        for (uint64_t word = bits[w]; word; word &= word - 1) {
+            struct test_list *list = &gi->tests[w * 64 + __builtin_ctzll(word)];
+            memcpy(idx + n, list->idx, list->len * sizeof(*idx));
+            n += list->len;
+        }
+
+    /* test may be given to many of user's groups */
+    qsort(idx, n, sizeof(*idx), compare_int);
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++)
+        if (unique == 0 || idx[unique - 1] != idx[i])
+            idx[unique++] = idx[i];
+
+    *len = unique;
+    return idx;
 }
 
 /**
- * Check if JSON object key has value equal to str
- * 
- * @param obj json_object of type json_type_object
+ * Load tests, users and groups from database image
+ *
+ * Tests are indexed by binary ids stored in image.
+ *
+ * @return 0 on success
  */
-static int key_value_equals_str(json_object *obj, const char *key, const char *str)
+static int load_image(const struct image *image)
 {
-    json_object *value;
-    if (json_object_object_get_ex(obj, key, &value) == TRUE)
-        if (json_object_is_type(value, json_type_string))
-            if (strcmp(json_object_get_string(value), str) == 0)
-                return 1;
+    json_object **collections[IMAGE_NCOLLECTIONS] = {
+        [IMAGE_TESTS] = &tests_db,
+        [IMAGE_USERS] = &users_db,
+        [IMAGE_GROUPS] = &groups_db
+    };
+    static const unsigned char no_id[16];
+
+    json_tokener *tok = json_tokener_new();
+    if (!tok)
+        return -1;
+
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++)
+        *collections[c] = json_object_new_array();
+
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++) {
+        for (size_t i = 0; i < image_count(image, c); i++) {
+            size_t len;
+            const unsigned char *id;
+            const char *text = image_record(image, c, i, &len, &id);
+
+            json_tokener_reset(tok);
+            json_object *record = json_tokener_parse_ex(tok, text, len);
+            if (!record || json_tokener_get_error(tok) != json_tokener_success) {
+                json_object_put(record);
+                goto err;
+            }
+            json_object_array_add(*collections[c], record);
+
+            if (c == IMAGE_TESTS && memcmp(id, no_id, sizeof(no_id)) != 0 &&
+                !hash_get(&tests_by_id, id, sizeof(uuid_t)))
+                if (hash_put(&tests_by_id, id, sizeof(uuid_t), record) != 0)
+                    goto err;
+        }
+    }
+
+    json_tokener_free(tok);
     return 0;
+
+err:
+    json_tokener_free(tok);
+    hash_free(&tests_by_id);
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++) {
+        json_object_put(*collections[c]);
+        *collections[c] = NULL;
+    }
+    return -1;
 }
 
+/**
+ * Write database image of collections as last written in background
+ *
+ * Called by snapshot writer thread, or while loading database.
+ */
+static void put_image(void)
+{
+    struct buffer buf;
+
+    /* Image is only a cache, server works without it */
+    buffer_init(&buf);
+    if (image_build(&buf, image_collections, image_sources) != 0 ||
+        snapshot_schedule(&image_snapshot, buffer_data(&buf), buffer_length(&buf)) != 0)
+        log_msg_at(LOG_LEVEL_WARNING, "%s: could not write database image\n", image_snapshot.path);
+    buffer_free(&buf);
+}
 
 /**
- * Check if JSON object key value equals uuid
- * 
- * @param obj json_object of type json_type_object
+ * Load database files into memory
+ *
+ * Files must hold JSON arrays. If database image was built from
+ * the same files, it's loaded instead. Answers are loaded
+ * separately, see load_answers().
+ *
+ * @return 0 on success
  */
-static int key_value_equals_uuid(json_object *obj, const char *key, uuid_t uuid)
+static int load_db(void)
 {
-    json_object *value;
-    if (json_object_object_get_ex(obj, key, &value) == TRUE)
-        if (json_object_is_type(value, json_type_string)) {
-            uuid_t uuid_in_obj;
-            if (uuid_parse(json_object_get_string(value), uuid_in_obj) == 0)
-                if (uuid_compare(uuid, uuid_in_obj) == 0)
-                    return 1;
+    FILE *files[IMAGE_NCOLLECTIONS] = {
+        [IMAGE_TESTS] = tests_file,
+        [IMAGE_USERS] = users_file,
+        [IMAGE_GROUPS] = groups_file
+    };
+    char *texts[IMAGE_NCOLLECTIONS] = {0};
+    int ret = -1;
+
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++) {
+        texts[c] = file_to_string(files[c]);
+        if (!texts[c])
+            goto out;
+        image_fingerprint(&image_sources[c], texts[c], strlen(texts[c]));
+    }
+
+    int from_image = 0;
+    struct image image;
+    if (image_open(&image, image_snapshot.path) == 0) {
+        from_image = image_matches(&image, image_sources) && load_image(&image) == 0;
+        image_close(&image);
+    }
+
+    if (!from_image) {
+        tests_db = json_tokener_parse(texts[IMAGE_TESTS]);
+        users_db = json_tokener_parse(texts[IMAGE_USERS]);
+        groups_db = json_tokener_parse(texts[IMAGE_GROUPS]);
+
+        if (!json_object_is_type(tests_db, json_type_array) ||
+            !json_object_is_type(users_db, json_type_array) ||
+            !json_object_is_type(groups_db, json_type_array)) {
+            log_msg("Database files must contain JSON arrays\n");
+            json_object_put(tests_db);
+            json_object_put(users_db);
+            json_object_put(groups_db);
+            goto out;
         }
-    return 0;
+
+        if (index_by_uuid(&tests_by_id, tests_db, "id") != 0)
+            goto out;
+    }
+
+    json_object *collections[IMAGE_NCOLLECTIONS] = {
+        [IMAGE_TESTS] = tests_db,
+        [IMAGE_USERS] = users_db,
+        [IMAGE_GROUPS] = groups_db
+    };
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++)
+        if (!(image_collections[c] = deep_copy(collections[c])))
+            goto out;
+    if (!from_image)
+        put_image();
+
+    if (index_by_name(&users_by_name, users_db) != 0 ||
+        build_groups_index(&groups_index, groups_db, tests_db) != 0)
+        goto out;
+
+    for (int i = 0; i < json_object_array_length(tests_db); i++)
+        if (add_test_views(json_object_array_get_idx(tests_db, i)) != 0)
+            goto out;
+
+    ret = load_answers();
+
+out:
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++)
+        free(texts[c]);
+
+    return ret;
 }
 
 /**
- * Check if JSON object key value is of type null
- * 
- * @param obj json_object of type json_type_object
+ * Get private copy of JSON object
+ *
+ * Objects of resident database must never be shared with callers,
+ * as json-c reference counts and serialization buffers aren't
+ * safe to use from many threads.
  */
-static int key_value_is_null(json_object *obj, const char *key)
+static json_object *deep_copy(json_object *obj)
 {
-    json_object *value;
-    if (json_object_object_get_ex(obj, key, &value) == TRUE)
-        if (json_object_is_type(value, json_type_null))
-            return 1;
-    return 0;
+    json_object *copy = NULL;
+
+    if (obj && json_object_deep_copy(obj, &copy, NULL) != 0)
+        log_msg("Could not copy database object\n");
+
+    return copy;
 }
 
-json_object *get_test(uuid_t id, json_object *tests)
+/**
+ * Get private copy of resident database object
+ *
+ * Caller is free to modify the copy and must release it.
+ */
+static json_object *copy_db_object(json_object *obj)
 {
-    if (!json_object_is_type(tests, json_type_array))
-        return NULL;
-        
-    for (int i = 0; i < json_object_array_length(tests); i++) {
-        json_object *test = json_object_array_get_idx(tests, i);
-        if (key_value_equals_uuid(test, "id", id))
-            return test;
-    }
+    pthread_rwlock_rdlock(&db_lock);
+    json_object *copy = deep_copy(obj);
+    pthread_rwlock_unlock(&db_lock);
 
-    return NULL;
+    return copy;
 }
 
-static json_object *get_test_answers_record(uuid_t test_id, json_object *answers)
+/**
+ * Get json_object containing users database
+ */
+json_object *get_users(void)
 {
-    if (!json_object_is_type(answers, json_type_array))
-        return NULL;
-    
-    for (int i = 0; i < json_object_array_length(answers); i++) {
-        json_object *test_record = json_object_array_get_idx(answers, i);
-        if (key_value_equals_uuid(test_record, "testId", test_id))
-            return test_record;
-    }
+    return copy_db_object(users_db);
+}
 
-    return NULL;
+/**
+ * Get json_object containing groups database
+ */
+json_object *get_groups(void)
+{
+    return copy_db_object(groups_db);
 }
 
-static json_object *create_test_answers_record(uuid_t test_id, json_object *answers)
+/**
+ * Get json_object containing single user or NULL if there is no such user
+ */
+json_object *get_user(const char *username)
 {
-    if (!json_object_is_type(answers, json_type_array))
-        return NULL;
+    pthread_rwlock_rdlock(&db_lock);
+    json_object *user = deep_copy(get_entity(username, users_db));
+    pthread_rwlock_unlock(&db_lock);
 
-    json_object *test_record = json_object_new_object();
-    
-    char s[37];
-    uuid_unparse(test_id, s);
-    
-    json_object_object_add(test_record, "testId", json_object_new_string(s));
-    json_object_object_add(test_record, "subjects", json_object_new_array());
-    
-    json_object_array_add(answers, test_record);
-    
-    return test_record;
+    return user;
 }
 
-static json_object *get_user_answers_record(uuid_t test_id, const char *username, json_object *answers)
+/* allocates memory! */
+static char *shard_path(uuid_t test_id)
 {
-    json_object *test_record = get_test_answers_record(test_id, answers);
-
+    char s[37];
+    uuid_unparse(test_id, s);
+
+    char *path;
+    if (asprintf(&path, "%s/%s", answers_dir, s) == -1)
+        return NULL;
+
+    return path;
+}
+
+/**
+ * Register shard of answers to test
+ *
+ * @param record test answers record or NULL if it should
+ * be loaded from shard file when needed
+ */
+static struct answers_shard *add_shard(uuid_t test_id, json_object *record)
+{
+    struct answers_shard *shard = calloc(1, sizeof(*shard));
+    if (!shard) {
+        log_errno("calloc");
+        return NULL;
+    }
+
+    uuid_copy(shard->test_id, test_id);
+    shard->record = record;
+
+    if (hash_put(&answers_by_test_id, test_id, sizeof(uuid_t), shard) != 0) {
+        free(shard);
+        return NULL;
+    }
+
+    shard->next = answers_shards;
+    answers_shards = shard;
+
+    return shard;
+}
+
+/**
+ * Read test answers record from shard file
+ *
+ * Caller must hold shards lock.
+ *
+ * @return NULL if file couldn't be read
+ */
+/* allocates memory! */
+static json_object *read_shard_file(uuid_t test_id)
+{
+    json_object *record = NULL;
+
+    char *path = shard_path(test_id);
+    FILE *fp = path ? fopen(path, "r") : NULL;
+    if (fp) {
+        record = get_json_from_file(fp);
+        fclose(fp);
+    }
+
+    if (!json_object_is_type(record, json_type_object)) {
+        log_msg("%s: could not load answers\n", path ? path : answers_dir);
+        json_object_put(record);
+        record = NULL;
+    }
+    free(path);
+
+    return record;
+}
+
+/**
+ * Get test answers record held by shard, loading it if necessary
+ *
+ * Caller must hold database lock, for reading at least.
+ *
+ * @return NULL if shard couldn't be loaded
+ */
+static json_object *shard_record(struct answers_shard *shard)
+{
+    pthread_mutex_lock(&shards_lock);
+
+    if (!shard->record && !shard->broken) {
+        shard->record = read_shard_file(shard->test_id);
+        if (!shard->record)
+            shard->broken = 1;
+    }
+
+    pthread_mutex_unlock(&shards_lock);
+
+    return shard->record;
+}
+
+/**
+ * Replace file with JSON data, waiting until it's durable
+ *
+ * @return 0 on success
+ */
+static int write_json_file(const char *path, json_object *obj)
+{
+    struct snapshot snapshot;
+
+    if (snapshot_init(&snapshot, path) != 0)
+        return -1;
+
+    const char *text = json_object_to_json_string_ext(obj, JSON_FLAGS);
+    int ret = snapshot_write(&snapshot, text, strlen(text));
+
+    snapshot_destroy(&snapshot);
+
+    return ret;
+}
+
+/**
+ * Write shard file, waiting until it's durable
+ *
+ * @return 0 on success
+ */
+static int put_shard(struct answers_shard *shard)
+{
+    /* file of shard that couldn't be loaded is kept as it is */
+    if (!shard->record)
+        return -1;
+
+    char *path = shard_path(shard->test_id);
+    if (!path)
+        return -1;
+
+    int ret = write_json_file(path, shard->record);
+
+    free(path);
+    return ret;
+}
+
+/**
+ * Register shards found in answers directory, creating it if necessary
+ *
+ * @return 0 on success
+ */
+static int scan_shards(void)
+{
+    if (mkdir(answers_dir, 0755) == -1 && errno != EEXIST) {
+        log_errno(answers_dir);
+        return -1;
+    }
+
+    DIR *dir = opendir(answers_dir);
+    if (!dir) {
+        log_errno(answers_dir);
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        uuid_t id;
+        /* Skips ".", ".." and temporary files of snapshots */
+        if (uuid_parse(entry->d_name, id) != 0)
+            continue;
+        if (!add_shard(id, NULL)) {
+            closedir(dir);
+            return -1;
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+/**
+ * Split answers file into shards
+ *
+ * Tests which already have a shard are skipped, as it has been
+ * written from answers file before.
+ *
+ * @return 0 on success
+ */
+static int migrate_answers_file(void)
+{
+    json_object *answers = get_json_from_file(answers_file);
+
+    /* Answers file may be empty */
+    if (!answers)
+        return 0;
+
+    if (!json_object_is_type(answers, json_type_array)) {
+        log_msg("Database files must contain JSON arrays\n");
+        json_object_put(answers);
+        return -1;
+    }
+
+    for (int i = 0; i < json_object_array_length(answers); i++) {
+        json_object *record = json_object_array_get_idx(answers, i);
+        uuid_t id;
+        if (!key_value_to_uuid(record, "testId", id) ||
+            hash_get(&answers_by_test_id, id, sizeof(uuid_t)))
+            continue;
+
+        struct answers_shard *shard = add_shard(id, json_object_get(record));
+        if (!shard) {
+            json_object_put(record);
+            json_object_put(answers);
+            return -1;
+        }
+        shard->dirty = 1;
+    }
+
+    json_object_put(answers);
+    return 0;
+}
+
+/**
+ * Load answers from shards, answers file and journal
+ *
+ * Changes are written to shards and journal is emptied. Loaded
+ * shards are released afterwards, they are reloaded when needed.
+ *
+ * @return 0 on success
+ */
+static int load_answers(void)
+{
+    if (scan_shards() != 0)
+        return -1;
+
+    if (answers_file && migrate_answers_file() != 0)
+        return -1;
+
+    int ignored;
+    int events = journal_replay(&answers_journal, apply_answers_event, &ignored);
+    if (events < 0)
+        return -1;
+    if (events > 0)
+        log_msg_at(LOG_LEVEL_INFO, "%s: replayed %d events\n", answers_journal.path, events);
+
+    for (struct answers_shard *shard = answers_shards; shard; shard = shard->next) {
+        if (shard->dirty && put_shard(shard) != 0)
+            return -1;
+        shard->dirty = 0;
+        json_object_put(shard->record);
+        shard->record = NULL;
+    }
+
+    /* Events that couldn't be applied are kept for when they can */
+    if (events > 0 && ignored == 0 && journal_truncate(&answers_journal) != 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Get json_object containing answers database
+ *
+ * Loads every shard.
+ */
+/* allocates memory! */
+json_object *get_answers(void)
+{
+    json_object *answers = json_object_new_array();
+
+    pthread_rwlock_rdlock(&db_lock);
+    for (struct answers_shard *shard = answers_shards; shard; shard = shard->next) {
+        json_object *record = shard_record(shard);
+        if (record)
+            json_object_array_add(answers, deep_copy(record));
+    }
+    pthread_rwlock_unlock(&db_lock);
+
+    return answers;
+}
+
+static void release_json(void *obj)
+{
+    json_object_put(obj);
+}
+
+/**
+ * Render collection as database file and rebuild image with it
+ *
+ * Called by snapshot writer thread, which keeps the collection.
+ */
+static int render_collection(int c, json_object *collection, struct buffer *out)
+{
+    const char *text = json_object_to_json_string_ext(collection, JSON_FLAGS);
+    size_t len = strlen(text);
+
+    if (buffer_append(out, text, len) != 0)
+        return -1;
+
+    image_fingerprint(&image_sources[c], text, len);
+    json_object_put(image_collections[c]);
+    image_collections[c] = json_object_get(collection);
+    put_image();
+
+    return 0;
+}
+
+static int render_tests(void *obj, struct buffer *out)
+{
+    return render_collection(IMAGE_TESTS, obj, out);
+}
+
+static int render_groups(void *obj, struct buffer *out)
+{
+    return render_collection(IMAGE_GROUPS, obj, out);
+}
+
+/**
+ * Write json_object to tests database in background
+ *
+ * Caller must hold database write lock. Only a copy is made under
+ * the lock, it's serialized by snapshot writer thread.
+ */
+static void put_tests(json_object *tests)
+{
+    json_object *copy = deep_copy(tests);
+    if (!copy)
+        log_msg_die("Out of memory\n");
+
+    snapshot_schedule_object(&tests_snapshot, copy);
+}
+
+/**
+ * Write json_object to groups database in background
+ *
+ * Caller must hold database write lock. Only a copy is made under
+ * the lock, it's serialized by snapshot writer thread.
+ */
+static void put_groups(json_object *groups)
+{
+    json_object *copy = deep_copy(groups);
+    if (!copy)
+        log_msg_die("Out of memory\n");
+
+    snapshot_schedule_object(&groups_snapshot, copy);
+}
+
+/**
+ * Check if JSON object key has value equal to str
+ * 
+ * @param obj json_object of type json_type_object
+ */
+static int key_value_equals_str(json_object *obj, const char *key, const char *str)
+{
+    json_object *value;
+    if (json_object_object_get_ex(obj, key, &value) == TRUE)
+        if (json_object_is_type(value, json_type_string))
+            if (strcmp(json_object_get_string(value), str) == 0)
+                return 1;
+    return 0;
+}
+
+
+/**
+ * Check if JSON object key value is of type null
+ * 
+ * @param obj json_object of type json_type_object
+ */
+static int key_value_is_null(json_object *obj, const char *key)
+{
+    json_object *value;
+    if (json_object_object_get_ex(obj, key, &value) == TRUE)
+        if (json_object_is_type(value, json_type_null))
+            return 1;
+    return 0;
+}
+
+/**
+ * Find test in resident database
+ */
+static json_object *find_test(uuid_t id)
+{
+    return hash_get(&tests_by_id, id, sizeof(uuid_t));
+}
+
+/* allocates memory! */
+json_object *get_test(uuid_t id)
+{
+    pthread_rwlock_rdlock(&db_lock);
+    json_object *test = deep_copy(find_test(id));
+    pthread_rwlock_unlock(&db_lock);
+
+    return test;
+}
+
+/* allocates memory! */
+json_object *get_test_for_examiner(uuid_t id, const char *username)
+{
+    pthread_rwlock_rdlock(&db_lock);
+    json_object *test = find_test(id);
+    if (!key_value_equals_str(test, "owner", username))
+        test = NULL;
+    test = deep_copy(test);
+    pthread_rwlock_unlock(&db_lock);
+
+    return test;
+}
+
+/**
+ * Get many tests at once
+ *
+ * Database is locked only once for all of them.
+ *
+ * @param owner only tests owned by this user are returned,
+ * NULL for any test
+ *
+ * @return array with test or null for each id, in the same order
+ */
+/* allocates memory! */
+json_object *get_tests_by_id(uuid_t *ids, size_t count, const char *owner)
+{
+    json_object *tests = json_object_new_array();
+    if (!tests)
+        return NULL;
+
+    pthread_rwlock_rdlock(&db_lock);
+
+    for (size_t i = 0; i < count; i++) {
+        json_object *test = find_test(ids[i]);
+        if (owner && !key_value_equals_str(test, "owner", owner))
+            test = NULL;
+        json_object_array_add(tests, deep_copy(test));
+    }
+
+    pthread_rwlock_unlock(&db_lock);
+
+    return tests;
+}
+
+static json_object *get_test_answers_record(uuid_t test_id)
+{
+    struct answers_shard *shard = hash_get(&answers_by_test_id, test_id, sizeof(uuid_t));
+    if (!shard)
+        return NULL;
+
+    return shard_record(shard);
+}
+
+/**
+ * Create test answers record in a new shard
+ *
+ * Caller must hold database write lock.
+ */
+static json_object *create_test_answers_record(uuid_t test_id)
+{
+    /* Shard that couldn't be loaded is never overwritten */
+    if (hash_get(&answers_by_test_id, test_id, sizeof(uuid_t)))
+        return NULL;
+
+    json_object *test_record = json_object_new_object();
+    
+    char s[37];
+    uuid_unparse(test_id, s);
+    
+    json_object_object_add(test_record, "testId", json_object_new_string(s));
+    json_object_object_add(test_record, "subjects", json_object_new_array());
+    
+    if (!add_shard(test_id, test_record)) {
+        json_object_put(test_record);
+        return NULL;
+    }
+    
+    return test_record;
+}
+
+static json_object *get_user_answers_record(uuid_t test_id, const char *username)
+{
+    json_object *test_record = get_test_answers_record(test_id);
+
     json_object *test_subjects;
     if (json_object_object_get_ex(test_record, "subjects", &test_subjects) != TRUE)
         return NULL;
@@ -355,99 +1394,519 @@ static json_object *get_user_answers_record(uuid_t test_id, const char *username
         }
     }
 
-    return NULL;
+    return NULL;
+}
+
+static json_object *create_user_answers_record(uuid_t test_id, const char *username,
+                                               int64_t creation_time)
+{
+    json_object *test_record = get_test_answers_record(test_id);
+
+    if (!test_record)
+        test_record = create_test_answers_record(test_id);
+
+    json_object *test_subjects;
+    if (json_object_object_get_ex(test_record, "subjects", &test_subjects) != TRUE)
+        return NULL;
+
+    if (!json_object_is_type(test_subjects, json_type_array))
+        return NULL;
+
+    json_object *user_record = json_object_new_object();
+    json_object_object_add(user_record, "name", json_object_new_string(username));
+    json_object_object_add(user_record, "answers", NULL);
+    json_object_object_add(user_record, "creationTime", json_object_new_int64(creation_time));
+
+    json_object_array_add(test_subjects, user_record);
+
+    return user_record;
+}
+
+/**
+ * Note change of user's answers
+ *
+ * Caller must hold database write lock.
+ */
+static void bump_answers_version(const char *username)
+{
+    uint64_t *version = hash_get(&answers_versions, username, strlen(username));
+
+    if (!version) {
+        version = calloc(1, sizeof(*version));
+        if (!version || hash_put(&answers_versions, username, strlen(username), version) != 0) {
+            free(version);
+            /* Can't track the user, make every reply stale instead */
+            tests_version++;
+            return;
+        }
+    }
+
+    (*version)++;
+}
+
+/**
+ * Get versions of data replies are made from
+ *
+ * @param username student whose replies depend on their groups and
+ * answers, NULL for replies depending on tests only
+ */
+void get_db_version(const char *username, struct db_version *version)
+{
+    pthread_rwlock_rdlock(&db_lock);
+
+    version->tests = tests_version;
+    version->groups = 0;
+    version->answers = 0;
+    if (username) {
+        uint64_t *answers = hash_get(&answers_versions, username, strlen(username));
+        version->groups = groups_version;
+        version->answers = answers ? *answers : 0;
+    }
+
+    pthread_rwlock_unlock(&db_lock);
+}
+
+/**
+ * Create event for answers journal
+ *
+ * @param type "create" for creation of user answers record,
+ * "answers" for submission of answers
+ */
+static json_object *new_answers_event(const char *type, uuid_t test_id, const char *username)
+{
+    char s[37];
+    uuid_unparse(test_id, s);
+
+    json_object *event = json_object_new_object();
+    json_object_object_add(event, "event", json_object_new_string(type));
+    json_object_object_add(event, "testId", json_object_new_string(s));
+    json_object_object_add(event, "name", json_object_new_string(username));
+
+    return event;
+}
+
+/**
+ * Append event to answers journal
+ *
+ * Takes ownership of event.
+ *
+ * @return number of the event in journal
+ */
+static uint64_t log_answers_event(json_object *event)
+{
+    uint64_t seq;
+
+    if (journal_append(&answers_journal, event, &seq) != 0)
+        log_msg_die("Database write error\n");
+
+    json_object_put(event);
+    return seq;
+}
+
+/**
+ * Apply event from answers journal to answers database
+ *
+ * Events may already be included in shards (if server crashed
+ * before journal was truncated), so applying them is idempotent.
+ * Events to shards that couldn't be loaded aren't applied.
+ *
+ * @return 0 on success
+ */
+static int apply_answers_event(json_object *event)
+{
+    json_object *type, *name;
+    uuid_t test_id;
+
+    if (json_object_object_get_ex(event, "event", &type) != TRUE ||
+        !json_object_is_type(type, json_type_string) ||
+        json_object_object_get_ex(event, "name", &name) != TRUE ||
+        !json_object_is_type(name, json_type_string) ||
+        !key_value_to_uuid(event, "testId", test_id))
+        return -1;
+
+    struct answers_shard *shard = hash_get(&answers_by_test_id, test_id, sizeof(uuid_t));
+    if (shard && !shard_record(shard))
+        return -1;
+
+    const char *username = json_object_get_string(name);
+    json_object *user_record = get_user_answers_record(test_id, username);
+
+    if (streq(json_object_get_string(type), "create")) {
+        json_object *creation_time;
+        if (json_object_object_get_ex(event, "creationTime", &creation_time) != TRUE ||
+            !json_object_is_type(creation_time, json_type_int))
+            return -1;
+        if (!user_record &&
+            !create_user_answers_record(test_id, username, json_object_get_int64(creation_time)))
+            return -1;
+    } else if (streq(json_object_get_string(type), "answers")) {
+        json_object *answers;
+        if (!user_record || json_object_object_get_ex(event, "answers", &answers) != TRUE)
+            return -1;
+        json_object_object_add(user_record, "answers", json_object_get(answers));
+    } else
+        return -1;
+
+    /* shard of a new record was only added now */
+    shard = hash_get(&answers_by_test_id, test_id, sizeof(uuid_t));
+    if (!shard || !shard->record)
+        return -1;
+    shard->dirty = 1;
+
+    return 0;
+}
+
+/**
+ * Create user answers record unless it already exists
+ *
+ * Record may have been created by another thread since caller
+ * looked it up, so the check is repeated under write lock.
+ *
+ * @return creation time of the record
+ */
+static int64_t open_user_answers_record(uuid_t test_id, const char *username)
+{
+    int64_t creation_time = 0;
+
+    pthread_rwlock_wrlock(&db_lock);
+
+    json_object *user_record = get_user_answers_record(test_id, username);
+    if (!user_record) {
+        creation_time = time(NULL);
+
+        json_object *event = new_answers_event("create", test_id, username);
+        json_object_object_add(event, "creationTime", json_object_new_int64(creation_time));
+        log_answers_event(event);
+
+        create_user_answers_record(test_id, username, creation_time);
+        bump_answers_version(username);
+    } else {
+        json_object *value;
+        if (json_object_object_get_ex(user_record, "creationTime", &value) == TRUE &&
+            json_object_is_type(value, json_type_int))
+            creation_time = json_object_get_int64(value);
+    }
+
+    pthread_rwlock_unlock(&db_lock);
+
+    return creation_time;
+}
+
+/**
+ * Check if user is a member of one of the groups specified in the test
+ *
+ * Caller must hold database lock.
+ */
+static int user_can_take_test(const char *username, json_object *test)
+{
+    json_object *test_groups;
+    if (json_object_object_get_ex(test, "groups", &test_groups) != TRUE ||
+        !json_object_is_type(test_groups, json_type_array))
+        return 0;
+
+    for (int i = 0; i < json_object_array_length(test_groups); i++) {
+        json_object *test_group = json_object_array_get_idx(test_groups, i);
+        if (!json_object_is_type(test_group, json_type_string))
+            continue;
+        if (user_is_group_member(username, json_object_get_string(test_group), groups_db))
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Serialize test without some of its keys
+ *
+ * @param drop keys to leave out, NULL-terminated
+ */
+/* allocates memory! */
+static char *serialize_view(json_object *test, const char *const *drop, size_t *len)
+{
+    json_object *view = deep_copy(test);
+    if (!view)
+        return NULL;
+
+    for (; *drop; drop++)
+        json_object_object_del(view, *drop);
+
+    const char *text = json_object_to_json_string_length(view, VIEW_FLAGS, len);
+    char *copy = text ? strdup(text) : NULL;
+
+    json_object_put(view);
+    return copy;
+}
+
+/**
+ * Build views of test appended to tests database
+ *
+ * Caller must hold database write lock, or be the only user of database.
+ *
+ * @return 0 on success
+ */
+static int add_test_views(json_object *test)
+{
+    static const char *const summary_drop[] = { "questions", "correctAnswers", NULL };
+    static const char *const student_drop[] = { "correctAnswers", NULL };
+    static const char *const results_drop[] = { NULL };
+
+    if (ntest_views == test_views_size) {
+        size_t size = test_views_size ? test_views_size * 2 : 16;
+        struct test_views **p = realloc(test_views, size * sizeof(*p));
+        if (!p) {
+            log_errno("realloc");
+            return -1;
+        }
+        test_views = p;
+        test_views_size = size;
+    }
+
+    struct test_views *views = calloc(1, sizeof(*views));
+    if (!views) {
+        log_errno("calloc");
+        return -1;
+    }
+
+    views->summary = serialize_view(test, summary_drop, &views->summary_len);
+    views->student = serialize_view(test, student_drop, &views->student_len);
+    views->results = serialize_view(test, results_drop, &views->results_len);
+    if (!views->summary || !views->student || !views->results)
+        goto err;
+
+    json_object *start_time, *end_time, *results_available;
+    if (json_object_object_get_ex(test, "startTime", &start_time) == TRUE &&
+        json_object_is_type(start_time, json_type_int) &&
+        json_object_object_get_ex(test, "endTime", &end_time) == TRUE &&
+        json_object_is_type(end_time, json_type_int) &&
+        json_object_object_get_ex(test, "resultsAvailable", &results_available) == TRUE &&
+        json_object_is_type(results_available, json_type_boolean)) {
+        views->has_times = 1;
+        views->start_time = json_object_get_int64(start_time);
+        views->end_time = json_object_get_int64(end_time);
+        views->results_available = json_object_get_boolean(results_available) == TRUE;
+    }
+
+    if (key_value_to_uuid(test, "id", views->id)) {
+        views->has_id = 1;
+        if (!hash_get(&views_by_id, views->id, sizeof(uuid_t)) &&
+            hash_put(&views_by_id, views->id, sizeof(uuid_t), views) != 0)
+            goto err;
+    }
+
+    test_views[ntest_views++] = views;
+    return 0;
+
+err:
+    free(views->summary);
+    free(views->student);
+    free(views->results);
+    free(views);
+    return -1;
+}
+
+/**
+ * Get number of options of question, 0 if question is invalid
+ */
+static size_t question_options(json_object *questions, size_t i)
+{
+    json_object *options;
+
+    if (json_object_object_get_ex(json_object_array_get_idx(questions, i), "options", &options) != TRUE ||
+        !json_object_is_type(options, json_type_array))
+        return 0;
+
+    return json_object_array_length(options);
+}
+
+/**
+ * Convert multiple choice answers between form sent by peers
+ * and packed form they are stored in
+ *
+ * Answers must be valid for the test. Selections with too
+ * many options to be packed are left as they are.
+ *
+ * @param pack pack answers if nonzero, unpack otherwise
+ */
+static void convert_answers(json_object *test, json_object *answers, int pack)
+{
+    json_object *questions;
+
+    if (!key_value_equals_str(test, "type", "multi") ||
+        json_object_object_get_ex(test, "questions", &questions) != TRUE ||
+        !json_object_is_type(questions, json_type_array) ||
+        !json_object_is_type(answers, json_type_array))
+        return;
+
+    for (size_t i = 0; i < json_object_array_length(answers); i++) {
+        json_object *selection = json_object_array_get_idx(answers, i);
+        size_t options = question_options(questions, i);
+        uint64_t mask;
+
+        if (json_object_is_type(selection, pack ? json_type_int : json_type_array) ||
+            selection_mask_stored(selection, options, &mask) != 0)
+            continue;
+
+        json_object_array_put_idx(answers, i, pack ? json_object_new_int64(mask) :
+                                                     selection_unpack(mask, options));
+    }
+}
+
+/**
+ * Fill in student's part of test reply from their answers record
+ *
+ * Caller must hold database lock, for reading at least.
+ *
+ * @param with_answers copy submitted answers too
+ *
+ * @return 1 if student has answers record, 0 otherwise
+ */
+static int read_student_record(uuid_t id, const char *username,
+                               struct student_test *st, int with_answers)
+{
+    json_object *user_record = get_user_answers_record(id, username);
+    if (!user_record)
+        return 0;
+
+    json_object *user_answers;
+    if (json_object_object_get_ex(user_record, "answers", &user_answers) == TRUE &&
+        !json_object_is_type(user_answers, json_type_null)) {
+        st->submitted = 1;
+        if (with_answers)
+            st->answers = deep_copy(user_answers);
+    }
+
+    json_object *creation_time;
+    if (json_object_object_get_ex(user_record, "creationTime", &creation_time) == TRUE &&
+        json_object_is_type(creation_time, json_type_int))
+        st->start_time = json_object_get_int64(creation_time);
+
+    return 1;
 }
 
-static int64_t create_user_answers_record(uuid_t test_id, const char *username, json_object *answers)
+/**
+ * Get test for student
+ *
+ * Correct answers are left out until test ends and examiner makes
+ * results available. Student's answers record is created on first
+ * request before end of test.
+ *
+ * @param st set to view of test and student's part of reply,
+ * release it with free_student_test()
+ *
+ * @return 0 on success, -1 if test isn't available to student
+ */
+int get_student_test(uuid_t id, const char *username, struct student_test *st)
 {
-    json_object *test_record = get_test_answers_record(test_id, answers);
+    memset(st, 0, sizeof(*st));
 
-    if (!test_record)
-        test_record = create_test_answers_record(test_id, answers);
+    pthread_rwlock_rdlock(&db_lock);
 
-    json_object *test_subjects;
-    if (json_object_object_get_ex(test_record, "subjects", &test_subjects) != TRUE)
-        return 0;
+    struct test_views *views = hash_get(&views_by_id, id, sizeof(uuid_t));
+    int64_t now = time(NULL);
 
-    if (!json_object_is_type(test_subjects, json_type_array))
-        return 0;
+    if (!user_can_take_test(username, find_test(id)) ||
+        !views || !views->has_times || now < views->start_time) {
+        pthread_rwlock_unlock(&db_lock);
+        return -1;
+    }
 
-    json_object *user_record = json_object_new_object();
-    json_object_object_add(user_record, "name", json_object_new_string(username));
-    json_object_object_add(user_record, "answers", NULL);
-    int64_t now = time(NULL);
-    json_object_object_add(user_record, "creationTime", json_object_new_int64(now));
+    if (now < views->end_time || !views->results_available) {
+        st->view = views->student;
+        st->view_len = views->student_len;
+    } else {
+        st->view = views->results;
+        st->view_len = views->results_len;
+    }
+    st->end_time = views->end_time;
 
-    json_object_array_add(test_subjects, user_record);
+    int has_record = read_student_record(id, username, st, 1);
+    /* Student gets answers back in the form they were sent in */
+    convert_answers(find_test(id), st->answers, 0);
+
+    pthread_rwlock_unlock(&db_lock);
+
+    /* If there is no answer record (i.e. student gets test for the first time)
+     * create an empty one with current time logged */
+    if (!has_record && now < st->end_time)
+        st->start_time = open_user_answers_record(id, username);
 
-    return now;
+    return 0;
 }
 
-json_object *get_test_for_student(uuid_t id, const char *username, json_object *tests)
+/**
+ * Get summaries of tests given to student
+ *
+ * @param count set to number of tests
+ *
+ * @return array to be released with free_student_tests()
+ */
+/* allocates memory! */
+struct student_test *get_student_tests(const char *username, size_t *count)
 {
-    json_object *test = get_test(id, tests);
+    pthread_rwlock_rdlock(&db_lock);
 
-    if (!json_object_is_type(test, json_type_object))
-        return NULL;
-    
-    json_object *start_time;
-    json_object *end_time;
-    json_object *results_available;
-
-    if (json_object_object_get_ex(test, "startTime", &start_time) != TRUE ||
-        !json_object_is_type(start_time, json_type_int) ||
-        json_object_object_get_ex(test, "endTime", &end_time) != TRUE ||
-        !json_object_is_type(end_time, json_type_int) ||
-        json_object_object_get_ex(test, "resultsAvailable", &results_available) != TRUE ||
-        !json_object_is_type(results_available, json_type_boolean))
-        return NULL;
-    
-    /* If test isn't available yet return nothing */   
-    int64_t now = time(NULL);
-    if (now < json_object_get_int64(start_time))
-        return NULL;
-    
-    /* If results haven't been made available by examinator
-     * remove correct answers */
-    if (now < json_object_get_int64(end_time) ||
-        json_object_get_boolean(results_available) != TRUE)
-        json_object_object_del(test, "correctAnswers");
-
-    json_object *answers = get_answers();
-    json_object *user_record = get_user_answers_record(id, username, answers);
-    
-    /* If there is no answer record (i.e. student gets test for the first time)
-     * create an empty one with current time logged */
-    int64_t user_start_time = 0;
-    if (!user_record) {
-        if (now < json_object_get_int64(end_time)) {
-            user_start_time = create_user_answers_record(id, username, answers);
-            put_answers(answers);
-        }
-    /* Else if user has submitted answers add them to test */    
-    } else {
-        json_object *user_answers;
-        if (json_object_object_get_ex(user_record, "answers", &user_answers) == TRUE &&
-            !json_object_is_type(user_answers, json_type_null)) {
-                json_object_object_add(test, "userAnswers", json_object_get(user_answers));
-                json_object_object_add(test, "userSubmittedAnswers", json_object_new_boolean(TRUE));
-        }
-                
-        json_object *creation_time;
-        if (json_object_object_get_ex(user_record, "creationTime", &creation_time) == TRUE &&
-            json_object_is_type(creation_time, json_type_int))
-                user_start_time = json_object_get_int64(creation_time);
+    /* Student needs to be a member of one of the groups
+     * specified in the test to receive it */
+    size_t len;
+    int *idx = groups_index_user_tests(&groups_index, username, &len);
+    struct student_test *tests = calloc(len ? len : 1, sizeof(*tests));
+
+    for (size_t i = 0; tests && i < len; i++) {
+        struct test_views *views = test_views[idx[i]];
+        tests[i].view = views->summary;
+        tests[i].view_len = views->summary_len;
+        tests[i].end_time = views->end_time;
+        if (views->has_id)
+            read_student_record(views->id, username, &tests[i], 0);
     }
-    
-    if (user_start_time != 0)
-        json_object_object_add(test, "userStartTime", json_object_new_int64(user_start_time));
 
-    json_object_put(answers);
-    return test;
+    pthread_rwlock_unlock(&db_lock);
+
+    free(idx);
+    *count = tests ? len : 0;
+    return tests;
+}
+
+void free_student_test(struct student_test *st)
+{
+    json_object_put(st->answers);
+}
+
+void free_student_tests(struct student_test *tests, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        free_student_test(&tests[i]);
+    free(tests);
 }
 
+/**
+ * Get index of resident entities array
+ *
+ * @return NULL if entities aren't part of resident database
+ */
+static struct hash_table *get_entity_index(json_object *entities)
+{
+    if (entities == users_db)
+        return &users_by_name;
+    return NULL;
+}
+
+/**
+ * Find user or group by name
+ *
+ * Lookups in resident database use index, other arrays are scanned.
+ */
 json_object *get_entity(const char *name, json_object *entities)
 {
+    struct hash_table *index = get_entity_index(entities);
+    if (index)
+        return hash_get(index, name, strlen(name));
+
+    if (entities == groups_db) {
+        int id = get_group_id(&groups_index, name);
+        return id >= 0 ? json_object_array_get_idx(groups_db, id) : NULL;
+    }
+
     if (!json_object_is_type(entities, json_type_array))
         return NULL;
         
@@ -464,6 +1923,10 @@ json_object *get_entity(const char *name, json_object *entities)
 
 int user_is_group_member(const char *username, const char *groupname, json_object *groups)
 {
+    if (groups == groups_db)
+        return groups_index_is_member(&groups_index, username,
+                                      get_group_id(&groups_index, groupname));
+
     json_object *group = get_entity(groupname, groups);
 
     json_object *members;
@@ -479,14 +1942,23 @@ int user_is_group_member(const char *username, const char *groupname, json_objec
     return 0;
 }
 
-int user_is_administrator(const char *username, json_object *groups)
+static int user_is_member(const char *username, const char *groupname)
+{
+    pthread_rwlock_rdlock(&db_lock);
+    int ret = user_is_group_member(username, groupname, groups_db);
+    pthread_rwlock_unlock(&db_lock);
+
+    return ret;
+}
+
+int user_is_administrator(const char *username)
 {
-    return user_is_group_member(username, "administrators", groups);
+    return user_is_member(username, "administrators");
 }
 
-int user_is_examiner(const char *username, json_object *groups)
+int user_is_examiner(const char *username)
 {
-    return user_is_group_member(username, "examiners", groups);
+    return user_is_member(username, "examiners");
 }
 
 int entity_exists(const char *name, json_object *obj)
@@ -494,112 +1966,391 @@ int entity_exists(const char *name, json_object *obj)
     return get_entity(name, obj) ? 1 : 0;
 }
 
-json_object *remove_qa_from_tests(json_object *tests)
+/**
+ * Write summaries of tests as JSON array
+ *
+ * Summaries are the prebuilt views of tests without questions
+ * and correct answers, the same ones students get.
+ *
+ * @param owner only tests owned by this user are written, NULL for any test
+ *
+ * @return 0 on success
+ */
+int get_test_summaries(const char *owner, struct buffer *out)
 {
-    if (!json_object_is_type(tests, json_type_array))
-        return NULL;
-        
-    for (int i = 0; i < json_object_array_length(tests); i++) {
-        json_object *test = json_object_array_get_idx(tests, i);
-        if (!json_object_is_type(test, json_type_object))
+    int err = buffer_puts(out, "[");
+    size_t n = 0;
+
+    pthread_rwlock_rdlock(&db_lock);
+
+    /* views are in the same order as tests */
+    for (size_t i = 0; i < ntest_views && !err; i++) {
+        if (owner && !key_value_equals_str(json_object_array_get_idx(tests_db, i), "owner", owner))
             continue;
-        json_object_object_del(test, "questions");
-        json_object_object_del(test, "correctAnswers");
+        err = (n++ > 0 && buffer_puts(out, ",") != 0) ||
+              buffer_append(out, test_views[i]->summary, test_views[i]->summary_len) != 0;
     }
 
-    return tests;
+    pthread_rwlock_unlock(&db_lock);
+
+    if (!err)
+        err = buffer_puts(out, "]");
+
+    return err ? -1 : 0;
+}
+
+/**
+ * Get score of user's answers to test, grading them on first request
+ *
+ * Caller must hold database lock, for reading at least.
+ *
+ * @param keep add new grade to grades table
+ */
+static void get_grade(uuid_t test_id, json_object *test, const char *username,
+                      json_object *answers, struct grade *grade, int keep)
+{
+    size_t name_len = strlen(username);
+    size_t key_len = sizeof(uuid_t) + name_len;
+    char *key = malloc(key_len);
+    if (!key) {
+        /* can still be graded, just not looked up */
+        log_errno("malloc");
+        grade_answers(test, answers, grade);
+        return;
+    }
+    memcpy(key, test_id, sizeof(uuid_t));
+    memcpy(key + sizeof(uuid_t), username, name_len);
+
+    pthread_mutex_lock(&grades_lock);
+    struct grade *cached = hash_get(&grades, key, key_len);
+    if (cached)
+        *grade = *cached;
+    pthread_mutex_unlock(&grades_lock);
+
+    if (cached)
+        goto out;
+
+    grade_answers(test, answers, grade);
+    if (!keep)
+        goto out;
+
+    cached = malloc(sizeof(*cached));
+    if (!cached) {
+        log_errno("malloc");
+        goto out;
+    }
+    *cached = *grade;
+
+    pthread_mutex_lock(&grades_lock);
+    struct grade *old = hash_remove(&grades, key, key_len);
+    if (hash_put(&grades, key, key_len, cached) != 0)
+        free(cached);
+    pthread_mutex_unlock(&grades_lock);
+    free(old);
+
+out:
+    free(key);
 }
 
+/**
+ * Get scores of all students who submitted answers to test
+ *
+ * @param owner only results of test owned by this user are returned,
+ * NULL for any test
+ *
+ * @return array of objects with name, score and maxScore,
+ * NULL if test isn't available
+ */
 /* allocates memory! */
-json_object *get_tests_for_examiner(const char *username)
+json_object *get_results(uuid_t id, const char *owner)
 {
-    json_object *tests = get_tests();
-    json_object *examiner_tests = json_object_new_array();
+    pthread_rwlock_rdlock(&db_lock);
 
-    if (!json_object_is_type(tests, json_type_array))
-        goto cleanup;
+    json_object *test = find_test(id);
+    if (!test || (owner && !key_value_equals_str(test, "owner", owner))) {
+        pthread_rwlock_unlock(&db_lock);
+        return NULL;
+    }
 
-    for (int i = 0; i < json_object_array_length(tests); i++) {
-        json_object *test = json_object_array_get_idx(tests, i);
-        json_object *owner;
-        if (json_object_object_get_ex(test, "owner", &owner) == TRUE) {
-            if (!json_object_is_type(owner, json_type_string))
+    json_object *results = json_object_new_array();
+    json_object *test_record = get_test_answers_record(id);
+    json_object *subjects;
+
+    if (results &&
+        json_object_object_get_ex(test_record, "subjects", &subjects) == TRUE &&
+        json_object_is_type(subjects, json_type_array)) {
+        for (size_t i = 0; i < json_object_array_length(subjects); i++) {
+            json_object *record = json_object_array_get_idx(subjects, i);
+            json_object *name, *answers;
+            struct grade grade;
+
+            if (json_object_object_get_ex(record, "name", &name) != TRUE ||
+                !json_object_is_type(name, json_type_string) ||
+                json_object_object_get_ex(record, "answers", &answers) != TRUE ||
+                json_object_is_type(answers, json_type_null))
                 continue;
-            if (strcmp(json_object_get_string(owner), username) == 0)
-                json_object_array_add(examiner_tests, json_object_get(test));
+
+            get_grade(id, test, json_object_get_string(name), answers, &grade, 1);
+
+            json_object *result = json_object_new_object();
+            json_object_object_add(result, "name", json_object_new_string(json_object_get_string(name)));
+            json_object_object_add(result, "score", json_object_new_int(grade.score));
+            json_object_object_add(result, "maxScore", json_object_new_int(grade.max_score));
+            json_object_array_add(results, result);
         }
-        
     }
 
-cleanup:
-    json_object_put(tests);
-    
-    return examiner_tests;
+    pthread_rwlock_unlock(&db_lock);
+
+    return results;
 }
 
-/* allocates memory! */
-json_object *get_tests_for_student(const char *username)
+/**
+ * Start export of submitted answers
+ *
+ * Only ids of tests to be exported are kept, answers are visited
+ * by export_answers() as they are exported.
+ *
+ * @param test_id export answers to this test only, NULL for any test
+ * @param group export tests given to this group and answers of its
+ * members only, NULL for any group
+ * @param owner export tests owned by this user only, NULL for any test
+ *
+ * @return 0 on success, -1 if test or group isn't available or on error
+ */
+int export_cursor_init(struct export_cursor *cur, uuid_t *test_id, const char *group,
+                       const char *owner)
 {
-    json_object *tests = get_tests();
-    json_object *groups = get_groups();
-    json_object *student_tests = json_object_new_array();
+    int ret = -1;
 
-    if (!json_object_is_type(tests, json_type_array))
-        goto cleanup;
+    memset(cur, 0, sizeof(*cur));
 
-    /* Student needs to be a member of one of the groups
-     * specified in the test to receive it */
-    for (int i = 0; i < json_object_array_length(tests); i++) {
-        json_object *test = json_object_array_get_idx(tests, i);
-        json_object *test_groups;
-        if (json_object_object_get_ex(test, "groups", &test_groups) == TRUE) {
-            if (!json_object_is_type(test_groups, json_type_array))
+    pthread_rwlock_rdlock(&db_lock);
+
+    if (test_id) {
+        json_object *test = find_test(*test_id);
+        if (!test || (owner && !key_value_equals_str(test, "owner", owner)))
+            goto out;
+        cur->test_ids = malloc(sizeof(uuid_t));
+        if (!cur->test_ids) {
+            log_errno("malloc");
+            goto out;
+        }
+        uuid_copy(cur->test_ids[0], *test_id);
+        cur->ntests = 1;
+    } else {
+        struct test_list *list = NULL;
+        size_t count = json_object_array_length(tests_db);
+        if (group) {
+            int id = get_group_id(&groups_index, group);
+            if (id < 0)
+                goto out;
+            list = &groups_index.tests[id];
+            count = list->len;
+        }
+
+        cur->test_ids = malloc((count ? count : 1) * sizeof(uuid_t));
+        if (!cur->test_ids) {
+            log_errno("malloc");
+            goto out;
+        }
+        for (size_t i = 0; i < count; i++) {
+            json_object *test = json_object_array_get_idx(tests_db, list ? list->idx[i] : i);
+            if ((!owner || key_value_equals_str(test, "owner", owner)) &&
+                key_value_to_uuid(test, "id", cur->test_ids[cur->ntests]))
+                cur->ntests++;
+        }
+    }
+
+    if (group && !(cur->group = strdup(group))) {
+        log_errno("strdup");
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    pthread_rwlock_unlock(&db_lock);
+
+    if (ret != 0)
+        export_cursor_free(cur);
+
+    return ret;
+}
+
+void export_cursor_free(struct export_cursor *cur)
+{
+    free(cur->test_ids);
+    free(cur->group);
+    json_object_put(cur->record);
+    cur->test_ids = NULL;
+    cur->group = NULL;
+    cur->record = NULL;
+}
+
+/**
+ * Get answers to test being exported
+ *
+ * Shards that aren't loaded are read for the cursor only, and dropped
+ * once it moves to the next test, so export doesn't load every shard.
+ * Caller must hold database lock, for reading at least.
+ */
+static json_object *export_record(struct export_cursor *cur, uuid_t test_id)
+{
+    if (cur->record)
+        return cur->record;
+
+    struct answers_shard *shard = hash_get(&answers_by_test_id, test_id, sizeof(uuid_t));
+    if (!shard)
+        return NULL;
+
+    pthread_mutex_lock(&shards_lock);
+    json_object *record = shard->record;
+    if (!record && !shard->broken)
+        record = cur->record = read_shard_file(test_id);
+    pthread_mutex_unlock(&shards_lock);
+
+    return record;
+}
+
+static void export_next_test(struct export_cursor *cur)
+{
+    json_object_put(cur->record);
+    cur->record = NULL;
+    cur->test++;
+    cur->subject = 0;
+}
+
+/**
+ * Visit submitted answers from where export stopped last time
+ *
+ * Database is only locked for the duration of a call, so the visitor
+ * must not keep anything from rows it's passed. Tests removed in
+ * the meantime are skipped. Grades of rows aren't kept, nor are
+ * answers loaded for export.
+ *
+ * @param visit called for each row, returns 1 to stop after the row,
+ * 0 to go on or -1 on error
+ *
+ * @return 1 if all rows were visited, 0 if visitor stopped, -1 on error
+ */
+int export_answers(struct export_cursor *cur,
+                   int (*visit)(const struct answers_row *row, void *arg), void *arg)
+{
+    int ret = 1;
+
+    pthread_rwlock_rdlock(&db_lock);
+
+    int group_id = cur->group ? get_group_id(&groups_index, cur->group) : -1;
+
+    for (; cur->test < cur->ntests; export_next_test(cur)) {
+        uuid_t *id = &cur->test_ids[cur->test];
+        json_object *test = find_test(*id);
+        json_object *subjects, *value;
+        if (!test ||
+            json_object_object_get_ex(export_record(cur, *id), "subjects", &subjects) != TRUE ||
+            !json_object_is_type(subjects, json_type_array))
+            continue;
+
+        struct answers_row row;
+        row.test_id = json_object_object_get_ex(test, "id", &value) == TRUE ?
+                      json_object_get_string(value) : "";
+        row.test_name = json_object_object_get_ex(test, "name", &value) == TRUE ?
+                        json_object_get_string(value) : "";
+
+        for (; cur->subject < json_object_array_length(subjects); cur->subject++) {
+            json_object *record = json_object_array_get_idx(subjects, cur->subject);
+            json_object *name, *answers;
+
+            if (json_object_object_get_ex(record, "name", &name) != TRUE ||
+                !json_object_is_type(name, json_type_string) ||
+                json_object_object_get_ex(record, "answers", &answers) != TRUE ||
+                json_object_is_type(answers, json_type_null))
                 continue;
-            for (int i = 0; i < json_object_array_length(test_groups); i++) {
-                json_object *test_group = json_object_array_get_idx(test_groups, i);
-                if (!json_object_is_type(test_group, json_type_string))
-                    continue;
-                if (user_is_group_member(username, json_object_get_string(test_group), groups)) {
-                    json_object_array_add(student_tests, json_object_get(test));
-                    break;
-                }
+
+            row.username = json_object_get_string(name);
+            if (cur->group && !groups_index_is_member(&groups_index, row.username, group_id))
+                continue;
+
+            json_object *user = hash_get(&users_by_name, row.username, strlen(row.username));
+            row.full_name = json_object_object_get_ex(user, "fullName", &value) == TRUE ?
+                            json_object_get_string(value) : "";
+
+            struct grade grade;
+            get_grade(*id, test, row.username, answers, &grade, 0);
+            row.score = grade.score;
+            row.max_score = grade.max_score;
+
+            row.answers = deep_copy(answers);
+            convert_answers(test, row.answers, 0);
+            int stop = visit(&row, arg);
+            json_object_put(row.answers);
+
+            if (stop != 0) {
+                cur->subject++;
+                ret = stop < 0 ? -1 : 0;
+                goto out;
             }
         }
     }
-    
-    /* Add userStartTime for each test for which user answer record exists */
-    json_object *answers = get_answers();
-    for (int i = 0; i < json_object_array_length(tests); i++) {
-        json_object *test = json_object_array_get_idx(tests, i);
-        json_object *test_id;
-        if (json_object_object_get_ex(test, "id", &test_id) && 
-                json_object_is_type(test_id, json_type_string)) {
-            uuid_t id;
-            uuid_parse(json_object_get_string(test_id), id);
-            json_object *user_record = get_user_answers_record(id, username, answers);
-            
-            if (user_record) {
-                json_object *creation_time;
-                if (json_object_object_get_ex(user_record, "creationTime", &creation_time) == TRUE &&
-                        json_object_is_type(creation_time, json_type_int))
-                    json_object_object_add(test, "userStartTime", json_object_get(creation_time));
-                
-                json_object *user_answers;
-                if (json_object_object_get_ex(user_record, "answers", &user_answers) == TRUE &&
-                    !json_object_is_type(user_answers, json_type_null)) {
-                        json_object_object_add(test, "userSubmittedAnswers", json_object_new_boolean(TRUE));
-                }
+
+out:
+    pthread_rwlock_unlock(&db_lock);
+
+    return ret;
+}
+
+/**
+ * Get item statistics of test
+ *
+ * Statistics are made from answers submitted so far on first request.
+ *
+ * @param owner only statistics of test owned by this user are returned,
+ * NULL for any test
+ *
+ * @return NULL if test isn't available
+ */
+/* allocates memory! */
+json_object *get_test_stats(uuid_t id, const char *owner)
+{
+    json_object *obj = NULL;
+
+    pthread_rwlock_rdlock(&db_lock);
+
+    json_object *test = find_test(id);
+    if (!test || (owner && !key_value_equals_str(test, "owner", owner))) {
+        pthread_rwlock_unlock(&db_lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+
+    struct test_stats *stats = hash_get(&stats_by_test_id, id, sizeof(uuid_t));
+    if (!stats && (stats = stats_create(test))) {
+        json_object *subjects;
+        if (json_object_object_get_ex(get_test_answers_record(id), "subjects", &subjects) == TRUE &&
+            json_object_is_type(subjects, json_type_array)) {
+            for (size_t i = 0; i < json_object_array_length(subjects); i++) {
+                json_object *answers;
+                if (json_object_object_get_ex(json_object_array_get_idx(subjects, i), "answers", &answers) == TRUE &&
+                    !json_object_is_type(answers, json_type_null))
+                    stats_add(stats, test, answers);
             }
         }
-            
+
+        if (hash_put(&stats_by_test_id, id, sizeof(uuid_t), stats) != 0) {
+            obj = stats_to_json(stats);
+            stats_free(stats);
+            stats = NULL;
+        }
     }
-    json_object_put(answers);
-     
-cleanup:
-    json_object_put(groups);
-    json_object_put(tests);
-    
-    return student_tests;
+    if (stats)
+        obj = stats_to_json(stats);
+
+    pthread_mutex_unlock(&stats_lock);
+    pthread_rwlock_unlock(&db_lock);
+
+    return obj;
 }
 
 int answers_to_test_are_valid(json_object *test, json_object *submitted_answers)
@@ -624,26 +2375,52 @@ int answers_to_test_are_valid(json_object *test, json_object *submitted_answers)
             if (json_object_object_get_ex(question, "options", &options) != TRUE ||
                 !json_object_is_type(options, json_type_array) ||
                 !json_object_is_type(submitted_answer, json_type_int) ||
-                json_object_get_int64(submitted_answers) < 0 ||
-                json_object_get_int64(submitted_answers) >= json_object_array_length(options)) {
+                json_object_get_int64(submitted_answer) < 0 ||
+                json_object_get_int64(submitted_answer) >= json_object_array_length(options)) {
                     
                 return 0;
             }
         }
         return 1;
     } else if (strcmp(json_object_get_string(test_type), "multi") == 0) {
-        /* TODO validate type multi answers */
+        for (int i = 0; i < len; i++) {
+            json_object *question = json_object_array_get_idx(questions, i);
+            json_object *submitted_answer = json_object_array_get_idx(submitted_answers, i);
+            json_object *options;
+            uint64_t mask;
+            if (json_object_object_get_ex(question, "options", &options) != TRUE ||
+                !json_object_is_type(options, json_type_array))
+                return 0;
+
+            size_t noptions = json_object_array_length(options);
+            if (noptions <= SELECTION_MAX_OPTIONS ?
+                selection_mask(submitted_answer, noptions, &mask) != 0 :
+                !is_array_of_json_type(submitted_answer, json_type_boolean) ||
+                json_object_array_length(submitted_answer) != noptions)
+                return 0;
+        }
         return 1;
     } else
         return 0;
 }
 
-int submit_answers(uuid_t id, const char *username, json_object *submitted_answers)
+/**
+ * Record answers of user to test
+ *
+ * Answers are not durable on return. Pass commit to
+ * wait_for_answers_commit() to learn when they are.
+ *
+ * @param commit its seq is set to the journal event of submission
+ *
+ * @return 0 on success
+ */
+int submit_answers(uuid_t id, const char *username, json_object *submitted_answers,
+                   struct journal_waiter *commit)
 {
-    json_object *tests = get_tests();
-    json_object *test = get_test(id, tests);
-    json_object *answers = get_answers();
-    json_object *user_answers_record = get_user_answers_record(id, username, answers);
+    pthread_rwlock_wrlock(&db_lock);
+
+    json_object *test = find_test(id);
+    json_object *user_answers_record = get_user_answers_record(id, username);
     int retval = -1;
 
     if (key_value_is_null(user_answers_record, "answers")) {
@@ -657,18 +2434,36 @@ int submit_answers(uuid_t id, const char *username, json_object *submitted_answe
             int64_t now = time(NULL);
             if (now < json_object_get_int64(creation_time) + json_object_get_int64(time_limit) * 60)
                 if (answers_to_test_are_valid(test, submitted_answers)) {
+                    convert_answers(test, submitted_answers, 1);
+                    json_object *event = new_answers_event("answers", id, username);
+                    json_object_object_add(event, "answers", json_object_get(submitted_answers));
+                    commit->seq = log_answers_event(event);
+                    bump_answers_version(username);
+
                     json_object_object_add(user_answers_record, "answers", submitted_answers);
-                    put_answers(answers);
+
+                    /* Readers are locked out, so stats_lock isn't needed */
+                    struct test_stats *stats = hash_get(&stats_by_test_id, id, sizeof(uuid_t));
+                    if (stats)
+                        stats_add(stats, test, submitted_answers);
                     retval = 0;
                 }
         }
     }
 
-    json_object_put(tests);
-    json_object_put(answers);
+    pthread_rwlock_unlock(&db_lock);
+
     return retval;
 }
 
+/**
+ * Run waiter once answers submitted with it are durable
+ */
+void wait_for_answers_commit(struct journal_waiter *commit)
+{
+    journal_wait(&answers_journal, commit);
+}
+
 int test_is_valid(json_object *test)
 {
     if (!json_object_is_type(test, json_type_object))
@@ -757,7 +2552,7 @@ int submit_test(const char *username, json_object *test)
     if (!test_is_valid(test))
         return -1;
 
-    json_object *tests = get_tests();
+    pthread_rwlock_wrlock(&db_lock);
 
     uuid_t id;
     char id_string[37];
@@ -768,9 +2563,15 @@ int submit_test(const char *username, json_object *test)
     json_object_object_add(test, "owner", json_object_new_string(username));
     json_object_object_add(test, "resultsAvailable", json_object_new_boolean(FALSE));
     
-    json_object_array_add(tests, test);
-    put_tests(tests);
-    json_object_put(tests);
+    json_object_array_add(tests_db, test);
+    if (hash_put(&tests_by_id, id, sizeof(uuid_t), test) != 0 ||
+        groups_index_add_test(&groups_index, test, json_object_array_length(tests_db) - 1) != 0 ||
+        add_test_views(test) != 0)
+        log_msg_die("Out of memory\n");
+    put_tests(tests_db);
+    tests_version++;
+
+    pthread_rwlock_unlock(&db_lock);
     
     return 0;
 }
@@ -851,6 +2652,22 @@ int submit_groups(json_object *groups)
     if (!groups_are_valid(groups))
         return -1;
         
-    put_groups(groups);
+    pthread_rwlock_wrlock(&db_lock);
+
+    struct groups_index index;
+    if (build_groups_index(&index, groups, tests_db) != 0) {
+        pthread_rwlock_unlock(&db_lock);
+        return -1;
+    }
+
+    json_object_put(groups_db);
+    groups_db = groups;
+    free_groups_index(&groups_index);
+    groups_index = index;
+    put_groups(groups_db);
+    groups_version++;
+
+    pthread_rwlock_unlock(&db_lock);
+
     return 0;
 }
@@ -1,27 +1,97 @@
+#include <stdint.h>
 #include <json-c/json.h>
 #include <uuid/uuid.h>
 
+struct buffer;
+struct journal_waiter;
+
+/**
+ * Versions of database parts, changed whenever they are modified
+ */
+struct db_version {
+    uint64_t tests;
+    uint64_t groups;
+    uint64_t answers;   /* of a single user */
+};
+
+/**
+ * Test as seen by a student
+ *
+ * View is shared and serialized, student's part
+ * of reply is added to it when it's sent.
+ */
+struct student_test {
+    const char *view;           /* JSON object, valid while database is open */
+    size_t view_len;
+    int64_t end_time;
+    int64_t start_time;         /* of student's attempt, 0 if none */
+    int submitted;              /* student has submitted answers */
+    json_object *answers;       /* submitted answers, only set for single test */
+};
+
+/**
+ * Submitted answers as passed to export visitor
+ *
+ * Valid only during the visit.
+ */
+struct answers_row {
+    const char *test_id;
+    const char *test_name;
+    const char *username;
+    const char *full_name;
+    json_object *answers;       /* in the form sent by peers */
+    int score;
+    int max_score;
+};
+
+/**
+ * Position of export, kept between calls to export_answers()
+ */
+struct export_cursor {
+    uuid_t *test_ids;           /* tests to be exported */
+    size_t ntests;
+    size_t test;                /* position of test being exported */
+    size_t subject;             /* position of next subject of that test */
+    char *group;                /* only members of group are exported, NULL for all */
+    json_object *record;        /* answers to that test read from a shard that
+                                   isn't loaded, NULL if it is */
+};
+
 int open_db(const char *db_dir);
 void close_db(void);
+int export_db_image(const char *db_dir);
+void get_db_version(const char *username, struct db_version *version);
 
 int entity_exists(const char *name, json_object *obj);
 json_object *get_entity(const char *name, json_object *entities);
-int user_is_examiner(const char *username, json_object *groups);
-int user_is_administrator(const char *username, json_object *groups);
+int user_is_examiner(const char *username);
+int user_is_administrator(const char *username);
 int user_is_group_member(const char *username, const char *groupname, json_object *groups);
 
-json_object *get_tests(void);
-json_object *get_tests_for_student(const char *username);
-json_object *get_tests_for_examiner(const char *username);
+int get_test_summaries(const char *owner, struct buffer *out);
 json_object *get_answers(void);
 json_object *get_users(void);
+json_object *get_user(const char *username);
 json_object *get_groups(void);
 
-json_object *remove_qa_from_tests(json_object *tests);
-
-json_object *get_test(uuid_t id, json_object *tests);
-json_object *get_test_for_student(uuid_t id, const char *username, json_object *tests);
+json_object *get_test(uuid_t id);
+json_object *get_test_for_examiner(uuid_t id, const char *username);
+json_object *get_tests_by_id(uuid_t *ids, size_t count, const char *owner);
+json_object *get_results(uuid_t id, const char *owner);
+json_object *get_test_stats(uuid_t id, const char *owner);
+int export_cursor_init(struct export_cursor *cur, uuid_t *test_id, const char *group,
+                       const char *owner);
+void export_cursor_free(struct export_cursor *cur);
+int export_answers(struct export_cursor *cur,
+                   int (*visit)(const struct answers_row *row, void *arg), void *arg);
+int get_student_test(uuid_t id, const char *username, struct student_test *st);
+struct student_test *get_student_tests(const char *username, size_t *count);
+void free_student_test(struct student_test *st);
+void free_student_tests(struct student_test *tests, size_t count);
 
+int answers_to_test_are_valid(json_object *test, json_object *submitted_answers);
 int submit_test(const char *username, json_object *test);
-int submit_answers(uuid_t id, const char *username, json_object *submitted_answers);
+int submit_answers(uuid_t id, const char *username, json_object *submitted_answers,
+                   struct journal_waiter *commit);
+void wait_for_answers_commit(struct journal_waiter *commit);
 int submit_groups(json_object *groups);
@@ -0,0 +1,223 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing export of submitted answers and their scores
+ * as CSV or NDJSON.
+ *
+ * Rows are formatted from the database a chunk at a time, as they are
+ * written, so memory used doesn't depend on the number of rows. Every
+ * row is a single line ending with CRLF, line breaks within CSV fields
+ * are replaced with spaces.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <json-c/json.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "output.h"
+#include "db.h"
+#include "export.h"
+
+/* Bytes produced by a single fill */
+#define EXPORT_CHUNK    (16 * 1024)
+#define JSON_FLAGS      JSON_C_TO_STRING_PLAIN
+
+#define CSV_HEADER      "testId,testName,name,fullName,score,maxScore,answers\r\n"
+
+struct export_stream {
+    struct output_source source;
+    struct export_cursor cur;
+    int format;
+    int started;
+    const char *end;
+    struct buffer *buf;         /* being filled */
+    size_t limit;               /* length of buf to stop at */
+};
+
+/**
+ * Get export format by name
+ *
+ * @return EXPORT_CSV, EXPORT_NDJSON or -1 if there is no such format
+ */
+int export_format(const char *name)
+{
+    if (strcasecmp(name, "CSV") == 0)
+        return EXPORT_CSV;
+    if (strcasecmp(name, "NDJSON") == 0)
+        return EXPORT_NDJSON;
+    return -1;
+}
+
+static int put_csv_field(struct buffer *buf, const char *s)
+{
+    if (!strpbrk(s, ",\"\r\n"))
+        return buffer_puts(buf, s);
+
+    if (buffer_puts(buf, "\"") != 0)
+        return -1;
+    while (*s) {
+        size_t n = strcspn(s, "\"\r\n");
+        if (buffer_append(buf, s, n) != 0)
+            return -1;
+        s += n;
+        if (*s == '\0')
+            break;
+        if (buffer_puts(buf, *s == '"' ? "\"\"" : " ") != 0)
+            return -1;
+        s++;
+    }
+
+    return buffer_puts(buf, "\"");
+}
+
+static int write_csv_row(const struct answers_row *row, struct buffer *buf)
+{
+    const char *fields[] = { row->test_id, row->test_name, row->username, row->full_name };
+
+    for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); i++)
+        if (put_csv_field(buf, fields[i]) != 0 || buffer_puts(buf, ",") != 0)
+            return -1;
+
+    if (buffer_printf(buf, "%d,%d,", row->score, row->max_score) != 0 ||
+        put_csv_field(buf, json_object_to_json_string_ext(row->answers, JSON_FLAGS)) != 0)
+        return -1;
+
+    return buffer_puts(buf, "\r\n");
+}
+
+static int write_ndjson_row(const struct answers_row *row, struct buffer *buf)
+{
+    json_object *obj = json_object_new_object();
+    if (!obj)
+        return -1;
+
+    json_object_object_add(obj, "testId", json_object_new_string(row->test_id));
+    json_object_object_add(obj, "testName", json_object_new_string(row->test_name));
+    json_object_object_add(obj, "name", json_object_new_string(row->username));
+    json_object_object_add(obj, "fullName", json_object_new_string(row->full_name));
+    json_object_object_add(obj, "score", json_object_new_int(row->score));
+    json_object_object_add(obj, "maxScore", json_object_new_int(row->max_score));
+    json_object_object_add(obj, "answers", json_object_get(row->answers));
+
+    int ret = buffer_puts(buf, json_object_to_json_string_ext(obj, JSON_FLAGS));
+    json_object_put(obj);
+    if (ret != 0)
+        return -1;
+
+    return buffer_puts(buf, "\r\n");
+}
+
+static int write_row(const struct answers_row *row, void *arg)
+{
+    struct export_stream *es = arg;
+
+    int ret = es->format == EXPORT_CSV ? write_csv_row(row, es->buf) :
+                                         write_ndjson_row(row, es->buf);
+    if (ret != 0)
+        return -1;
+
+    return buffer_length(es->buf) >= es->limit;
+}
+
+static int export_stream_fill(struct output_source *src, struct buffer *buf)
+{
+    struct export_stream *es = container_of(src, struct export_stream, source);
+
+    es->buf = buf;
+    es->limit = buffer_length(buf) + EXPORT_CHUNK;
+
+    if (!es->started) {
+        es->started = 1;
+        if (es->format == EXPORT_CSV && buffer_puts(buf, CSV_HEADER) != 0)
+            return -1;
+    }
+
+    int ret = export_answers(&es->cur, write_row, es);
+    if (ret != 1)
+        return ret;
+
+    return buffer_puts(buf, es->end) == 0 ? 1 : -1;
+}
+
+static void export_stream_free(struct output_source *src)
+{
+    struct export_stream *es = container_of(src, struct export_stream, source);
+
+    export_cursor_free(&es->cur);
+    free(es);
+}
+
+/**
+ * Create source exporting answers from cursor
+ *
+ * Source takes ownership of cursor on success.
+ *
+ * @param end written after last row
+ *
+ * @return NULL on error
+ */
+struct output_source *export_stream_new(int format, struct export_cursor *cur, const char *end)
+{
+    struct export_stream *es = malloc(sizeof(*es));
+    if (!es) {
+        log_errno("malloc");
+        return NULL;
+    }
+
+    es->source.fill = export_stream_fill;
+    es->source.free = export_stream_free;
+    es->cur = *cur;
+    es->format = format;
+    es->started = 0;
+    es->end = end;
+    es->buf = NULL;
+    es->limit = 0;
+
+    return &es->source;
+}
+
+/**
+ * Export answers from cursor to file
+ *
+ * Cursor is released.
+ *
+ * @return 0 on success
+ */
+int export_to_file(FILE *fp, int format, struct export_cursor *cur)
+{
+    struct output_source *src = export_stream_new(format, cur, "");
+    if (!src) {
+        export_cursor_free(cur);
+        return -1;
+    }
+
+    struct buffer buf;
+    buffer_init(&buf);
+
+    int ret;
+    do {
+        ret = src->fill(src, &buf);
+        if (ret >= 0 &&
+            fwrite(buffer_data(&buf), 1, buffer_length(&buf), fp) != buffer_length(&buf)) {
+            log_errno("fwrite");
+            ret = -1;
+        }
+        buffer_consume(&buf, buffer_length(&buf));
+    } while (ret == 0);
+
+    buffer_free(&buf);
+    src->free(src);
+
+    if (ret >= 0 && fflush(fp) != 0) {
+        log_errno("fflush");
+        ret = -1;
+    }
+
+    return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,13 @@
+#include <stdio.h>
+
+struct output_source;
+struct export_cursor;
+
+enum {
+    EXPORT_CSV,
+    EXPORT_NDJSON
+};
+
+int export_format(const char *name);
+struct output_source *export_stream_new(int format, struct export_cursor *cur, const char *end);
+int export_to_file(FILE *fp, int format, struct export_cursor *cur);
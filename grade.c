@@ -0,0 +1,108 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing grading of submitted answers.
+ *
+ * Each question is worth one point. Single choice question is answered
+ * correctly by the index of the correct option, multiple choice question
+ * by exactly the same selection of options as in correct answer.
+ *
+ * Selections are compared packed into words, see selection.c. Only
+ * questions with too many options to be packed are compared option
+ * by option.
+ */
+
+#include <stdio.h>
+
+#include "common.h"
+#include "selection.h"
+#include "grade.h"
+
+static int selections_equal(json_object *correct, json_object *answer)
+{
+    if (!json_object_is_type(correct, json_type_array) ||
+        !json_object_is_type(answer, json_type_array))
+        return 0;
+
+    size_t len = json_object_array_length(correct);
+    if (json_object_array_length(answer) != len)
+        return 0;
+
+    for (size_t i = 0; i < len; i++) {
+        json_object *c = json_object_array_get_idx(correct, i);
+        json_object *a = json_object_array_get_idx(answer, i);
+        if (!json_object_is_type(c, json_type_boolean) ||
+            !json_object_is_type(a, json_type_boolean) ||
+            json_object_get_boolean(c) != json_object_get_boolean(a))
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Check if question is answered correctly
+ *
+ * @param multi question is multiple choice
+ * @param options number of options of question
+ *
+ * @return 1 if it is, 0 otherwise
+ */
+int grade_question(int multi, size_t options, json_object *correct, json_object *answer)
+{
+    if (multi) {
+        uint64_t correct_mask, answer_mask;
+
+        if (options > SELECTION_MAX_OPTIONS)
+            return selections_equal(correct, answer);
+
+        return selection_mask_stored(correct, options, &correct_mask) == 0 &&
+               selection_mask_stored(answer, options, &answer_mask) == 0 &&
+               correct_mask == answer_mask;
+    }
+
+    return json_object_is_type(correct, json_type_int) &&
+           json_object_is_type(answer, json_type_int) &&
+           json_object_get_int64(correct) == json_object_get_int64(answer);
+}
+
+/**
+ * Score answers submitted to test
+ *
+ * Answers that don't fit the test score no points.
+ */
+void grade_answers(json_object *test, json_object *answers, struct grade *grade)
+{
+    json_object *type, *questions, *correct_answers;
+
+    grade->score = 0;
+    grade->max_score = 0;
+
+    if (json_object_object_get_ex(test, "type", &type) != TRUE ||
+        json_object_object_get_ex(test, "questions", &questions) != TRUE ||
+        json_object_object_get_ex(test, "correctAnswers", &correct_answers) != TRUE ||
+        !json_object_is_type(type, json_type_string) ||
+        !json_object_is_type(questions, json_type_array) ||
+        !json_object_is_type(correct_answers, json_type_array))
+        return;
+
+    int multi = streq(json_object_get_string(type), "multi");
+    grade->max_score = json_object_array_length(correct_answers);
+
+    if (!json_object_is_type(answers, json_type_array))
+        return;
+
+    for (int i = 0; i < grade->max_score; i++) {
+        json_object *question = json_object_array_get_idx(questions, i);
+        json_object *options;
+        if (json_object_object_get_ex(question, "options", &options) != TRUE ||
+            !json_object_is_type(options, json_type_array))
+            continue;
+
+        grade->score += grade_question(multi, json_object_array_length(options),
+                                       json_object_array_get_idx(correct_answers, i),
+                                       json_object_array_get_idx(answers, i));
+    }
+}
@@ -0,0 +1,13 @@
+#include <stddef.h>
+#include <json-c/json.h>
+
+/**
+ * Score of a single submission
+ */
+struct grade {
+    int score;          /* number of correctly answered questions */
+    int max_score;      /* number of correct answers given by test */
+};
+
+int grade_question(int multi, size_t options, json_object *correct, json_object *answer);
+void grade_answers(json_object *test, json_object *answers, struct grade *grade);
@@ -0,0 +1,181 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing hash tables used for database indexes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "hash.h"
+
+#define HASH_MIN_SIZE 16
+
+/* 64-bit FNV-1a */
+uint64_t hash_bytes(const void *key, size_t key_len)
+{
+    const unsigned char *p = key;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < key_len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/**
+ * Initialize empty hash table
+ */
+void hash_init(struct hash_table *ht)
+{
+    ht->buckets = NULL;
+    ht->size = 0;
+    ht->count = 0;
+}
+
+/**
+ * Remove all entries and release memory held by hash table
+ */
+void hash_free(struct hash_table *ht)
+{
+    hash_free_all(ht, NULL);
+}
+
+/**
+ * Remove all entries and release memory held by hash table
+ * and by values of its entries
+ *
+ * @param free_value function releasing a value
+ */
+void hash_free_all(struct hash_table *ht, void (*free_value)(void *value))
+{
+    for (size_t i = 0; i < ht->size; i++) {
+        struct hash_entry *e = ht->buckets[i];
+        while (e) {
+            struct hash_entry *next = e->next;
+            if (free_value)
+                free_value(e->value);
+            free(e);
+            e = next;
+        }
+    }
+    free(ht->buckets);
+    hash_init(ht);
+}
+
+static struct hash_entry **find_entry(const struct hash_table *ht, uint64_t hash,
+                                      const void *key, size_t key_len)
+{
+    struct hash_entry **e = &ht->buckets[hash & (ht->size - 1)];
+
+    for (; *e; e = &(*e)->next)
+        if ((*e)->hash == hash && (*e)->key_len == key_len &&
+            memcmp((*e)->key, key, key_len) == 0)
+            break;
+
+    return e;
+}
+
+static int resize(struct hash_table *ht, size_t size)
+{
+    struct hash_entry **buckets = calloc(size, sizeof(*buckets));
+    if (!buckets) {
+        log_errno("calloc");
+        return -1;
+    }
+
+    for (size_t i = 0; i < ht->size; i++) {
+        struct hash_entry *e = ht->buckets[i];
+        while (e) {
+            struct hash_entry *next = e->next;
+            size_t idx = e->hash & (size - 1);
+            e->next = buckets[idx];
+            buckets[idx] = e;
+            e = next;
+        }
+    }
+
+    free(ht->buckets);
+    ht->buckets = buckets;
+    ht->size = size;
+    return 0;
+}
+
+/**
+ * Insert entry or replace value of existing one
+ *
+ * @return 0 on success
+ */
+int hash_put(struct hash_table *ht, const void *key, size_t key_len, void *value)
+{
+    if (ht->count >= ht->size &&
+        resize(ht, ht->size ? ht->size * 2 : HASH_MIN_SIZE) != 0)
+        return -1;
+
+    uint64_t hash = hash_bytes(key, key_len);
+    struct hash_entry **e = find_entry(ht, hash, key, key_len);
+    if (*e) {
+        (*e)->value = value;
+        return 0;
+    }
+
+    struct hash_entry *entry = malloc(sizeof(*entry) + key_len);
+    if (!entry) {
+        log_errno("malloc");
+        return -1;
+    }
+
+    entry->next = NULL;
+    entry->hash = hash;
+    entry->value = value;
+    entry->key_len = key_len;
+    memcpy(entry->key, key, key_len);
+
+    *e = entry;
+    ht->count++;
+    return 0;
+}
+
+/**
+ * Look up value by key
+ *
+ * @return value or NULL if there is no such key
+ */
+void *hash_get(const struct hash_table *ht, const void *key, size_t key_len)
+{
+    if (ht->count == 0)
+        return NULL;
+
+    struct hash_entry *e = *find_entry(ht, hash_bytes(key, key_len), key, key_len);
+
+    return e ? e->value : NULL;
+}
+
+/**
+ * Remove entry
+ *
+ * @return value of removed entry or NULL if there is no such key
+ */
+void *hash_remove(struct hash_table *ht, const void *key, size_t key_len)
+{
+    if (ht->count == 0)
+        return NULL;
+
+    struct hash_entry **e = find_entry(ht, hash_bytes(key, key_len), key, key_len);
+    struct hash_entry *entry = *e;
+    if (!entry)
+        return NULL;
+
+    void *value = entry->value;
+    *e = entry->next;
+    free(entry);
+    ht->count--;
+
+    return value;
+}
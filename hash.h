@@ -0,0 +1,31 @@
+#include <stddef.h>
+#include <stdint.h>
+
+struct hash_entry {
+    struct hash_entry *next;
+    uint64_t hash;
+    void *value;
+    size_t key_len;
+    unsigned char key[];
+};
+
+/**
+ * Hash table mapping byte string keys to pointers
+ *
+ * Keys are copied into the table, values are not owned by it.
+ */
+struct hash_table {
+    struct hash_entry **buckets;
+    size_t size;    /* number of buckets, power of two */
+    size_t count;   /* number of entries */
+};
+
+uint64_t hash_bytes(const void *key, size_t key_len);
+
+void hash_init(struct hash_table *ht);
+void hash_free(struct hash_table *ht);
+void hash_free_all(struct hash_table *ht, void (*free_value)(void *value));
+
+int hash_put(struct hash_table *ht, const void *key, size_t key_len, void *value);
+void *hash_get(const struct hash_table *ht, const void *key, size_t key_len);
+void *hash_remove(struct hash_table *ht, const void *key, size_t key_len);
@@ -0,0 +1,255 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing binary database image.
+ *
+ * Image holds tests, users and groups so that server can start without
+ * parsing pretty-printed database files. It is memory-mapped and read
+ * in place. Layout, in host byte order:
+ *
+ *  - header: magic, version, fingerprints of source files
+ *    and location of record table of each collection
+ *  - records: 32-bit length followed by compact JSON text
+ *  - record tables: offset of each record and binary id
+ *    (all zeros if record has no "id")
+ *
+ * Image is only a cache, it's valid as long as fingerprints
+ * match contents of database files.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <uuid/uuid.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "hash.h"
+#include "image.h"
+
+#define IMAGE_MAGIC     "ETSTIMG\n"
+#define IMAGE_VERSION   1
+
+struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t ncollections;
+    struct image_source sources[IMAGE_NCOLLECTIONS];
+    struct {
+        uint64_t table;     /* offset of record table */
+        uint64_t count;     /* number of records */
+    } collections[IMAGE_NCOLLECTIONS];
+};
+
+struct image_entry {
+    uint64_t offset;        /* offset of record length */
+    unsigned char id[16];
+};
+
+void image_fingerprint(struct image_source *source, const char *data, size_t len)
+{
+    source->size = len;
+    source->hash = hash_bytes(data, len);
+}
+
+/**
+ * Serialize collections into image
+ *
+ * Caller must make sure collections aren't modified meanwhile.
+ *
+ * @param out buffer image is appended to
+ * @param collections JSON arrays
+ * @param sources fingerprints of files collections were read from
+ *
+ * @return 0 on success
+ */
+int image_build(struct buffer *out, json_object *collections[IMAGE_NCOLLECTIONS],
+                const struct image_source sources[IMAGE_NCOLLECTIONS])
+{
+    struct image_header header = {0};
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.ncollections = IMAGE_NCOLLECTIONS;
+    memcpy(header.sources, sources, sizeof(header.sources));
+
+    size_t base = out->len;
+    if (buffer_append(out, &header, sizeof(header)) != 0)
+        return -1;
+
+    struct image_entry *tables[IMAGE_NCOLLECTIONS] = {0};
+    int ret = -1;
+
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++) {
+        size_t count = json_object_array_length(collections[c]);
+        tables[c] = calloc(count ? count : 1, sizeof(struct image_entry));
+        if (!tables[c]) {
+            log_errno("calloc");
+            goto out;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            json_object *record = json_object_array_get_idx(collections[c], i);
+            size_t len;
+            const char *json = json_object_to_json_string_length(record, JSON_C_TO_STRING_PLAIN, &len);
+            uint32_t len32 = len;
+
+            json_object *id;
+            if (json_object_object_get_ex(record, "id", &id) == TRUE &&
+                json_object_is_type(id, json_type_string))
+                uuid_parse(json_object_get_string(id), tables[c][i].id);
+
+            tables[c][i].offset = out->len - base;
+            if (buffer_append(out, &len32, sizeof(len32)) != 0 ||
+                buffer_append(out, json, len) != 0)
+                goto out;
+        }
+    }
+
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++) {
+        size_t count = json_object_array_length(collections[c]);
+
+        /* Keep entries aligned */
+        while ((out->len - base) % sizeof(uint64_t))
+            if (buffer_append(out, "", 1) != 0)
+                goto out;
+
+        header.collections[c].table = out->len - base;
+        header.collections[c].count = count;
+        if (buffer_append(out, tables[c], count * sizeof(struct image_entry)) != 0)
+            goto out;
+    }
+
+    memcpy(out->data + base, &header, sizeof(header));
+    ret = 0;
+
+out:
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++)
+        free(tables[c]);
+
+    return ret;
+}
+
+static int image_is_valid(const struct image *image)
+{
+    if (image->size < sizeof(struct image_header))
+        return 0;
+
+    const struct image_header *header = (const void *) image->data;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != IMAGE_VERSION ||
+        header->ncollections != IMAGE_NCOLLECTIONS)
+        return 0;
+
+    for (int c = 0; c < IMAGE_NCOLLECTIONS; c++) {
+        uint64_t table = header->collections[c].table;
+        uint64_t count = header->collections[c].count;
+        if (table % sizeof(uint64_t) != 0 || table > image->size ||
+            count > (image->size - table) / sizeof(struct image_entry))
+            return 0;
+
+        const struct image_entry *entries = (const void *) (image->data + table);
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t offset = entries[i].offset;
+            uint32_t len;
+            if (offset > image->size - sizeof(len))
+                return 0;
+            memcpy(&len, image->data + offset, sizeof(len));
+            if (len > image->size - offset - sizeof(len))
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Map image file into memory
+ *
+ * @return 0 on success, -1 if image is missing or damaged
+ */
+int image_open(struct image *image, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            log_errno((char *) path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        log_errno((char *) path);
+        close(fd);
+        return -1;
+    }
+
+    image->size = st.st_size;
+    image->data = image->size ? mmap(NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (image->data == MAP_FAILED) {
+        if (image->size)
+            log_errno((char *) path);
+        return -1;
+    }
+
+    if (!image_is_valid(image)) {
+        log_msg_at(LOG_LEVEL_WARNING, "%s: damaged database image\n", path);
+        image_close(image);
+        return -1;
+    }
+
+    return 0;
+}
+
+void image_close(struct image *image)
+{
+    munmap((void *) image->data, image->size);
+}
+
+/**
+ * Check if image was built from database files with given fingerprints
+ */
+int image_matches(const struct image *image, const struct image_source sources[IMAGE_NCOLLECTIONS])
+{
+    const struct image_header *header = (const void *) image->data;
+
+    return memcmp(header->sources, sources, sizeof(header->sources)) == 0;
+}
+
+size_t image_count(const struct image *image, int collection)
+{
+    const struct image_header *header = (const void *) image->data;
+
+    return header->collections[collection].count;
+}
+
+/**
+ * Get record of collection
+ *
+ * @param len set to length of record
+ * @param id set to binary id of record
+ *
+ * @return compact JSON text of record, not null-terminated
+ */
+const char *image_record(const struct image *image, int collection, size_t i,
+                         size_t *len, const unsigned char **id)
+{
+    const struct image_header *header = (const void *) image->data;
+    const struct image_entry *entry = (const void *) (image->data + header->collections[collection].table);
+
+    uint32_t len32;
+    memcpy(&len32, image->data + entry[i].offset, sizeof(len32));
+
+    *len = len32;
+    *id = entry[i].id;
+    return (const char *) image->data + entry[i].offset + sizeof(len32);
+}
@@ -0,0 +1,44 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <json-c/json.h>
+
+struct buffer;
+
+/* Collections stored in database image, in this order */
+enum {
+    IMAGE_TESTS,
+    IMAGE_USERS,
+    IMAGE_GROUPS,
+    IMAGE_NCOLLECTIONS
+};
+
+/**
+ * Fingerprint of JSON file an image collection was built from
+ */
+struct image_source {
+    uint64_t size;
+    uint64_t hash;
+};
+
+/**
+ * Database image mapped into memory
+ *
+ * Records are compact JSON texts read in place from the mapping.
+ */
+struct image {
+    const unsigned char *data;
+    size_t size;
+};
+
+void image_fingerprint(struct image_source *source, const char *data, size_t len);
+
+int image_build(struct buffer *out, json_object *collections[IMAGE_NCOLLECTIONS],
+                const struct image_source sources[IMAGE_NCOLLECTIONS]);
+
+int image_open(struct image *image, const char *path);
+void image_close(struct image *image);
+
+int image_matches(const struct image *image, const struct image_source sources[IMAGE_NCOLLECTIONS]);
+size_t image_count(const struct image *image, int collection);
+const char *image_record(const struct image *image, int collection, size_t i,
+                         size_t *len, const unsigned char **id);
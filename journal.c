@@ -0,0 +1,323 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing append-only journals of database changes.
+ *
+ * Each event is a single line of plain JSON. Events are only ever
+ * appended, so recording a change costs one small sequential write.
+ *
+ * Durability is provided by group commit. Writers don't fsync; they
+ * register a waiter instead, and committer thread syncs everything
+ * appended so far once per batch, then runs the waiters.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <json-c/json.h>
+
+#include "common.h"
+#include "metrics.h"
+#include "journal.h"
+
+/* How long committer collects events before syncing them */
+#define GROUP_COMMIT_WINDOW_US  2000
+
+/* Shared by all journals */
+static struct metric journal_metrics[] = {
+    { .name = "journal append" },
+    { .name = "journal sync" }
+};
+static struct metric *const append_metric = &journal_metrics[0];
+static struct metric *const sync_metric = &journal_metrics[1];
+static int metrics_registered;
+
+/**
+ * Open journal, creating it if necessary
+ *
+ * @return 0 on success
+ */
+int journal_open(struct journal *journal, const char *path)
+{
+    journal->path = strdup(path);
+    journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal->fd == -1) {
+        log_errno(journal->path);
+        free(journal->path);
+        return -1;
+    }
+
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->appended_cond, NULL);
+    journal->appended = 0;
+    journal->synced = 0;
+    journal->waiters = NULL;
+
+    return 0;
+}
+
+void journal_close(struct journal *journal)
+{
+    close(journal->fd);
+    free(journal->path);
+}
+
+static char *read_journal(struct journal *journal, size_t *len)
+{
+    struct stat st;
+    if (fstat(journal->fd, &st) == -1) {
+        log_errno(journal->path);
+        return NULL;
+    }
+
+    char *buf = malloc(st.st_size + 1);
+    if (!buf) {
+        log_errno("malloc");
+        return NULL;
+    }
+
+    size_t done = 0;
+    while (done < st.st_size) {
+        ssize_t n = pread(journal->fd, buf + done, st.st_size - done, done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == -1)
+                log_errno(journal->path);
+            free(buf);
+            return NULL;
+        }
+        done += n;
+    }
+
+    buf[done] = '\0';
+    *len = done;
+    return buf;
+}
+
+/**
+ * Pass every event in journal to apply function
+ *
+ * Replay stops at first line that can't be parsed, which is normally
+ * an event torn by a crash in the middle of append. That line and
+ * everything after it is cut off, so new events start on a clean line.
+ *
+ * @param ignored set to number of events apply function failed on
+ *
+ * @return number of events replayed or -1 on error
+ */
+int journal_replay(struct journal *journal, int (*apply)(json_object *event), int *ignored)
+{
+    *ignored = 0;
+
+    size_t len;
+    char *buf = read_journal(journal, &len);
+    if (!buf)
+        return -1;
+
+    int count = 0;
+    char *line = buf;
+    char *end = buf + len;
+    while (line < end) {
+        char *newline = memchr(line, '\n', end - line);
+        if (!newline) {
+            log_msg_at(LOG_LEVEL_WARNING, "%s: discarding incomplete event at the end\n", journal->path);
+            goto torn;
+        }
+        *newline = '\0';
+
+        json_object *event = json_tokener_parse(line);
+        if (!event) {
+            log_msg_at(LOG_LEVEL_WARNING, "%s: discarding unreadable event and following ones\n",
+                       journal->path);
+            goto torn;
+        }
+        if (apply(event) != 0) {
+            (*ignored)++;
+            log_msg_at(LOG_LEVEL_WARNING, "%s: ignoring invalid event: %s\n", journal->path, line);
+        }
+        json_object_put(event);
+
+        count++;
+        line = newline + 1;
+    }
+
+    free(buf);
+    return count;
+
+torn:
+    if (ftruncate(journal->fd, line - buf) == -1) {
+        log_errno(journal->path);
+        count = -1;
+    }
+
+    free(buf);
+    return count;
+}
+
+/**
+ * Append event to journal
+ *
+ * Event is not durable until committer syncs it, see journal_wait().
+ *
+ * @param seq set to number of appended event
+ *
+ * @return 0 on success
+ */
+int journal_append(struct journal *journal, json_object *event, uint64_t *seq)
+{
+    char *line;
+    int len = asprintf(&line, "%s\n", json_object_to_json_string_ext(event, JSON_C_TO_STRING_PLAIN));
+    if (len == -1) {
+        log_msg("Out of memory\n");
+        return -1;
+    }
+
+    uint64_t start = metric_now();
+
+    /* Events are numbered in the same order they are written */
+    pthread_mutex_lock(&journal->lock);
+
+    int done = 0;
+    while (done < len) {
+        ssize_t n = write(journal->fd, line + done, len - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            log_errno(journal->path);
+            pthread_mutex_unlock(&journal->lock);
+            metric_record(append_metric, start, 1);
+            free(line);
+            return -1;
+        }
+        done += n;
+    }
+
+    *seq = ++journal->appended;
+    pthread_cond_signal(&journal->appended_cond);
+    pthread_mutex_unlock(&journal->lock);
+
+    metric_add_bytes(append_metric, len);
+    metric_record(append_metric, start, 0);
+
+    free(line);
+    return 0;
+}
+
+/**
+ * Discard all events
+ *
+ * Called once events are included in a durable snapshot.
+ *
+ * @return 0 on success
+ */
+int journal_truncate(struct journal *journal)
+{
+    if (ftruncate(journal->fd, 0) == -1 || fsync(journal->fd) == -1) {
+        log_errno(journal->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Run waiter once event waiter->seq is durable
+ *
+ * Waiter is run by committer thread, or right away by caller
+ * if the event has already been synced.
+ */
+void journal_wait(struct journal *journal, struct journal_waiter *waiter)
+{
+    pthread_mutex_lock(&journal->lock);
+
+    if (waiter->seq > journal->synced) {
+        waiter->next = journal->waiters;
+        journal->waiters = waiter;
+        pthread_mutex_unlock(&journal->lock);
+        return;
+    }
+
+    pthread_mutex_unlock(&journal->lock);
+    waiter->fn(waiter);
+}
+
+static void *committer_thread(void *arg)
+{
+    struct journal *journal = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&journal->lock);
+        while (journal->appended == journal->synced)
+            pthread_cond_wait(&journal->appended_cond, &journal->lock);
+        pthread_mutex_unlock(&journal->lock);
+
+        /* Let concurrent writers join the batch */
+        usleep(GROUP_COMMIT_WINDOW_US);
+
+        pthread_mutex_lock(&journal->lock);
+        uint64_t batch_end = journal->appended;
+        pthread_mutex_unlock(&journal->lock);
+
+        /* Every event up to batch_end has been written */
+        uint64_t start = metric_now();
+        if (fdatasync(journal->fd) == -1)
+            log_errno_die(journal->path);
+        metric_record(sync_metric, start, 0);
+
+        pthread_mutex_lock(&journal->lock);
+        journal->synced = batch_end;
+
+        struct journal_waiter *ready = NULL;
+        struct journal_waiter **link = &journal->waiters;
+        while (*link) {
+            struct journal_waiter *waiter = *link;
+            if (waiter->seq <= batch_end) {
+                *link = waiter->next;
+                waiter->next = ready;
+                ready = waiter;
+            } else
+                link = &waiter->next;
+        }
+        pthread_mutex_unlock(&journal->lock);
+
+        while (ready) {
+            struct journal_waiter *waiter = ready;
+            ready = waiter->next;
+            waiter->fn(waiter);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start thread making appended events durable
+ *
+ * @return 0 on success
+ */
+int journal_start_committer(struct journal *journal)
+{
+    if (!metrics_registered) {
+        metrics_registered = 1;
+        metrics_register(journal_metrics, sizeof(journal_metrics) / sizeof(*journal_metrics));
+    }
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, committer_thread, journal);
+    if (ret != 0) {
+        log_msg("pthread_create: %s\n", strerror(ret));
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include <pthread.h>
+#include <json-c/json.h>
+
+/**
+ * Callback run once journal is durable up to given event
+ *
+ * Meant to be embedded in caller's structure, like struct work.
+ */
+struct journal_waiter {
+    void (*fn)(struct journal_waiter *waiter);
+    struct journal_waiter *next;
+    uint64_t seq;
+};
+
+/**
+ * Append-only log of JSON events, one per line
+ *
+ * Events are numbered from 1 in order of appending. Committer thread
+ * makes them durable in batches, so that a single fsync covers every
+ * event appended while the previous one was in progress.
+ */
+struct journal {
+    int fd;
+    char *path;
+
+    pthread_mutex_t lock;
+    pthread_cond_t appended_cond;
+    uint64_t appended;      /* number of last event written */
+    uint64_t synced;        /* number of last durable event */
+    struct journal_waiter *waiters;
+};
+
+int journal_open(struct journal *journal, const char *path);
+void journal_close(struct journal *journal);
+
+int journal_replay(struct journal *journal, int (*apply)(json_object *event), int *ignored);
+int journal_append(struct journal *journal, json_object *event, uint64_t *seq);
+int journal_truncate(struct journal *journal);
+
+int journal_start_committer(struct journal *journal);
+void journal_wait(struct journal *journal, struct journal_waiter *waiter);
@@ -22,6 +22,9 @@
 #include "common.h"
 #include "db.h"
 #include "protocol.h"
+#include "server.h"
+#include "export.h"
+#include "metrics.h"
 
 #define DEFAULT_DB_DIR "./examples" /* change later */
 #define DEFAULT_PORT "50000"
@@ -29,6 +32,24 @@
 
 static const char *db_dir = DEFAULT_DB_DIR;
 static const char *port = DEFAULT_PORT;
+static int workers = 0; /* 0 means one per online CPU */
+/* Where metrics are dumped in Prometheus format, NULL if not */
+static const char *metrics_file;
+static const char *metrics_socket;
+
+/* Convert database instead of serving it */
+static enum {
+    MODE_SERVE,
+    MODE_BUILD_IMAGE,
+    MODE_EXPORT_JSON,
+    MODE_EXPORT
+} mode = MODE_SERVE;
+
+/* What --export writes */
+static int export_format_arg;
+static uuid_t export_test_id;
+static int export_test_set;
+static const char *export_group;
 
 static __attribute__ ((unused)) void print_addrinfo(struct addrinfo *ai)
 {
@@ -83,7 +104,7 @@ static int create_listening_socket(const char *port)
     int sfd;
     for (rp = result; rp != NULL; rp = rp->ai_next) {
         /* print_addrinfo(rp); */
-        sfd = socket(rp->ai_family, rp->ai_socktype,
+        sfd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
                     rp->ai_protocol);
         if (sfd == -1) {
             log_errno("socket");
@@ -111,31 +132,13 @@ static int create_listening_socket(const char *port)
     return -1;
 }
 
-static int accept_connection(int listen_fd)
-{
-    struct sockaddr_storage peer_addr;
-    socklen_t peer_addr_len = sizeof(struct sockaddr_storage);
-    int peer_fd = accept(listen_fd, (struct sockaddr *) &peer_addr, &peer_addr_len);
-
-    if (peer_fd == -1) {
-        int ret;
-        int saved_errno = errno;
-        char host[NI_MAXHOST];
-        ret = getnameinfo((struct sockaddr *) &peer_addr, peer_addr_len, host, NI_MAXHOST,
-                            NULL, 0, NI_NUMERICHOST);
-        if (ret == 0)
-            log_msg("Failed to accept connection from %s: %s\n", host, strerror(saved_errno));
-        else {
-            log_msg("Failed to accept connection: %s\n", strerror(saved_errno));
-        }
-    }
-
-    return peer_fd;
-}
-
 static void print_usage(char *arg0)
 {
-    fprintf(stderr, "Usage: %s [--db-dir DIR] [--port PORT] [-h|--help]\n", arg0);
+    fprintf(stderr, "Usage: %s [--db-dir DIR] [--port PORT] [--workers N] [--max-body BYTES]\n"
+                    "       [--metrics-file PATH] [--metrics-socket PATH]\n"
+                    "       [--log-level error|warning|info|debug] [-h|--help]\n", arg0);
+    fprintf(stderr, "       %s [--db-dir DIR] --build-image|--export-json\n", arg0);
+    fprintf(stderr, "       %s [--db-dir DIR] --export csv|ndjson [--test UUID|--group NAME]\n", arg0);
 }
 
 static void print_help(char *arg0)
@@ -152,11 +155,31 @@ static void parse_args(int argc, char* argv[])
     enum {
         ARG_DB_DIR,
         ARG_PORT,
+        ARG_WORKERS,
+        ARG_MAX_BODY,
+        ARG_METRICS_FILE,
+        ARG_LOG_LEVEL,
+        ARG_METRICS_SOCKET,
+        ARG_BUILD_IMAGE,
+        ARG_EXPORT_JSON,
+        ARG_EXPORT,
+        ARG_TEST,
+        ARG_GROUP,
     };
     
     static struct option long_options[] = {
         {"db-dir", required_argument, 0, ARG_DB_DIR},
         {"port", required_argument, 0, ARG_PORT},
+        {"workers", required_argument, 0, ARG_WORKERS},
+        {"max-body", required_argument, 0, ARG_MAX_BODY},
+        {"metrics-file", required_argument, 0, ARG_METRICS_FILE},
+        {"log-level", required_argument, 0, ARG_LOG_LEVEL},
+        {"metrics-socket", required_argument, 0, ARG_METRICS_SOCKET},
+        {"build-image", no_argument, 0, ARG_BUILD_IMAGE},
+        {"export-json", no_argument, 0, ARG_EXPORT_JSON},
+        {"export", required_argument, 0, ARG_EXPORT},
+        {"test", required_argument, 0, ARG_TEST},
+        {"group", required_argument, 0, ARG_GROUP},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
@@ -169,6 +192,76 @@ static void parse_args(int argc, char* argv[])
             case ARG_DB_DIR:
                 db_dir = optarg;
                 break;
+            case ARG_WORKERS:
+            {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 1 || n > 1024) {
+                    fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                workers = n;
+                break;
+            }
+            case ARG_MAX_BODY:
+            {
+                char *end;
+                long long n = strtoll(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 1) {
+                    fprintf(stderr, "Invalid maximum body size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                set_max_body_size(n);
+                break;
+            }
+            case ARG_LOG_LEVEL:
+            {
+                static const char *levels[] = {
+                    [LOG_LEVEL_ERROR] = "error",
+                    [LOG_LEVEL_WARNING] = "warning",
+                    [LOG_LEVEL_INFO] = "info",
+                    [LOG_LEVEL_DEBUG] = "debug"
+                };
+                int level = 0;
+                while (level <= LOG_LEVEL_DEBUG && strcasecmp(optarg, levels[level]) != 0)
+                    level++;
+                if (level > LOG_LEVEL_DEBUG) {
+                    fprintf(stderr, "Invalid log level: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                log_set_level(level);
+                break;
+            }
+            case ARG_METRICS_FILE:
+                metrics_file = optarg;
+                break;
+            case ARG_METRICS_SOCKET:
+                metrics_socket = optarg;
+                break;
+            case ARG_BUILD_IMAGE:
+                mode = MODE_BUILD_IMAGE;
+                break;
+            case ARG_EXPORT_JSON:
+                mode = MODE_EXPORT_JSON;
+                break;
+            case ARG_EXPORT:
+                export_format_arg = export_format(optarg);
+                if (export_format_arg < 0) {
+                    fprintf(stderr, "Invalid export format: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                mode = MODE_EXPORT;
+                break;
+            case ARG_TEST:
+                if (uuid_parse(optarg, export_test_id) != 0) {
+                    fprintf(stderr, "Invalid test id: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                export_test_set = 1;
+                break;
+            case ARG_GROUP:
+                export_group = optarg;
+                break;
             case 'h':
                 print_help(argv[0]);
                 exit(EXIT_SUCCESS);
@@ -180,7 +273,8 @@ static void parse_args(int argc, char* argv[])
         }
     }
 
-    if (optind < argc) {
+    if (optind < argc || (mode != MODE_EXPORT && (export_test_set || export_group)) ||
+        (export_test_set && export_group)) {
         print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
@@ -190,8 +284,36 @@ int main(int argc, char *argv[])
 {
     parse_args(argc, argv);
 
+    if (mode == MODE_EXPORT_JSON) {
+        if (export_db_image(db_dir) != 0)
+            log_msg_die("Error exporting database image of %s\n", db_dir);
+        return 0;
+    }
+
+    /* Server never waits for its log, converting modes just write it */
+    if (mode == MODE_SERVE && log_start() != 0)
+        log_msg_die("Could not start logging\n");
+
     if (open_db(db_dir) != 0)
         log_msg_die("Error opening database %s\n", db_dir);
+
+    /* Opening database brings its image up to date */
+    if (mode == MODE_BUILD_IMAGE) {
+        close_db();
+        return 0;
+    }
+
+    if (mode == MODE_EXPORT) {
+        struct export_cursor cur;
+        if (export_cursor_init(&cur, export_test_set ? &export_test_id : NULL,
+                               export_group, NULL) != 0)
+            log_msg_die("No such test or group to export\n");
+        int ret = export_to_file(stdout, export_format_arg, &cur);
+        close_db();
+        if (ret != 0)
+            log_msg_die("Error exporting answers\n");
+        return 0;
+    }
     
     int listen_fd = create_listening_socket(port);
     if (listen_fd == -1)
@@ -199,28 +321,20 @@ int main(int argc, char *argv[])
 
     signal(SIGPIPE, SIG_IGN);
 
-    for (;;) {
-        int peer_fd = accept_connection(listen_fd);
-        if (peer_fd == -1)
-            continue;
+    register_request_metrics();
+    if (metrics_file && metrics_start_file(metrics_file) != 0)
+        log_msg_die("Could not start writing metrics to %s\n", metrics_file);
+    if (metrics_socket && metrics_start_socket(metrics_socket) != 0)
+        log_msg_die("Could not create metrics socket %s\n", metrics_socket);
 
-        FILE *peer_stream = fdopen(peer_fd, "r+");
-        if (!peer_stream) {
-            log_errno("Could not associate stream with fd");
-            close(peer_fd);
-            continue;
-        }
-        setlinebuf(peer_stream);
-
-        send_reply_ok(peer_stream, "Etestd %s", VERSION);
-        struct credentials peer_creds = { NULL, AUTH_LEVEL_UNAUTHORIZED };
+    if (workers == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = n > 0 ? n : 1;
+    }
 
-        while (handle_request(&peer_creds, peer_stream) == 0)
-            ;
+    log_msg_at(LOG_LEVEL_INFO, "Serving %s on port %s with %d workers\n", db_dir, port, workers);
 
-        free(peer_creds.username);
-        fclose(peer_stream);
-    }
+    run_server(listen_fd, "Etestd " VERSION, workers);
 
     close_db();
     close(listen_fd);
@@ -0,0 +1,420 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing counters and latency histograms of operations.
+ *
+ * Modules keep their own metrics and register them once at startup.
+ * Recording only updates counters of a single metric with relaxed
+ * atomics, so it never waits for other threads. Histogram buckets grow
+ * by powers of two, from under a microsecond to over half an hour, and
+ * percentiles are estimated by interpolating within a bucket.
+ *
+ * Registered metrics are reported as JSON, or as Prometheus text
+ * written periodically to a file or to every peer connecting to
+ * a Unix socket.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "metrics.h"
+
+#define MAX_METRIC_GROUPS       16
+/* Seconds between writes of metrics file */
+#define METRICS_FILE_INTERVAL   10
+/* Seconds to wait after accepting on metrics socket fails, e.g. out of
+ * file descriptors, and the longest a reader may stall a write */
+#define METRICS_SOCKET_BACKOFF  1
+#define METRICS_SOCKET_TIMEOUT  5
+
+static struct {
+    struct metric *metrics;
+    size_t count;
+} groups[MAX_METRIC_GROUPS];
+static size_t ngroups;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get monotonic time in nanoseconds
+ */
+uint64_t metric_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Record operation which started at given time and has just ended
+ *
+ * @param start time returned by metric_now()
+ * @param error nonzero if operation failed
+ */
+void metric_record(struct metric *m, uint64_t start, int error)
+{
+    uint64_t ns = metric_now() - start;
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= METRIC_BUCKETS)
+        bucket = METRIC_BUCKETS - 1;
+
+    __atomic_add_fetch(&m->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->buckets[bucket], 1, __ATOMIC_RELAXED);
+    if (error)
+        __atomic_add_fetch(&m->errors, 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&m->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&m->max_ns, &max, ns, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * Count bytes transferred by operation
+ */
+void metric_add_bytes(struct metric *m, uint64_t bytes)
+{
+    __atomic_add_fetch(&m->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Make metrics available to reports
+ *
+ * Metrics must stay valid while the program runs.
+ */
+void metrics_register(struct metric *metrics, size_t count)
+{
+    pthread_mutex_lock(&registry_lock);
+
+    if (ngroups < MAX_METRIC_GROUPS) {
+        groups[ngroups].metrics = metrics;
+        groups[ngroups].count = count;
+        ngroups++;
+    } else
+        log_msg_at(LOG_LEVEL_WARNING, "Too many metric groups, %s not registered\n", metrics[0].name);
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void read_metric(const struct metric *m, struct metric *copy)
+{
+    copy->name = m->name;
+    copy->errors = __atomic_load_n(&m->errors, __ATOMIC_RELAXED);
+    copy->bytes = __atomic_load_n(&m->bytes, __ATOMIC_RELAXED);
+    copy->total_ns = __atomic_load_n(&m->total_ns, __ATOMIC_RELAXED);
+    copy->max_ns = __atomic_load_n(&m->max_ns, __ATOMIC_RELAXED);
+
+    /* count agrees with histogram */
+    copy->count = 0;
+    for (int i = 0; i < METRIC_BUCKETS; i++) {
+        copy->buckets[i] = __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+        copy->count += copy->buckets[i];
+    }
+}
+
+/**
+ * Estimate duration under which given part of operations took
+ *
+ * @param q part of operations, 0 to 1
+ *
+ * @return duration in microseconds
+ */
+static double percentile_us(const struct metric *m, double q)
+{
+    double rank = q * m->count;
+    double max = m->max_ns / 1000.0;
+    uint64_t seen = 0;
+
+    if (m->count == 0)
+        return 0;
+
+    for (int i = 0; i < METRIC_BUCKETS; i++) {
+        if (m->buckets[i] > 0 && seen + m->buckets[i] >= rank) {
+            double lower = i ? (double) (UINT64_C(1) << (i - 1)) : 0;
+            double upper = (double) (UINT64_C(1) << i);
+            double us = lower + (upper - lower) * (rank - seen) / m->buckets[i];
+            /* estimate can't exceed what was seen */
+            return us < max ? us : max;
+        }
+        seen += m->buckets[i];
+    }
+
+    return max;
+}
+
+/**
+ * Report registered metrics
+ *
+ * @return array of objects with name, count, errors, bytes and
+ * mean, median, 99th percentile and maximum duration in microseconds
+ */
+/* allocates memory! */
+json_object *metrics_to_json(void)
+{
+    json_object *array = json_object_new_array();
+
+    pthread_mutex_lock(&registry_lock);
+
+    for (size_t g = 0; g < ngroups; g++) {
+        for (size_t i = 0; i < groups[g].count; i++) {
+            struct metric m;
+            read_metric(&groups[g].metrics[i], &m);
+            if (!m.name)
+                continue;
+
+            json_object *obj = json_object_new_object();
+            json_object_object_add(obj, "name", json_object_new_string(m.name));
+            json_object_object_add(obj, "count", json_object_new_int64(m.count));
+            json_object_object_add(obj, "errors", json_object_new_int64(m.errors));
+            json_object_object_add(obj, "bytes", json_object_new_int64(m.bytes));
+            json_object_object_add(obj, "meanUs",
+                json_object_new_double(m.count ? m.total_ns / 1000.0 / m.count : 0));
+            json_object_object_add(obj, "p50Us", json_object_new_double(percentile_us(&m, 0.5)));
+            json_object_object_add(obj, "p99Us", json_object_new_double(percentile_us(&m, 0.99)));
+            json_object_object_add(obj, "maxUs", json_object_new_double(m.max_ns / 1000.0));
+            json_object_array_add(array, obj);
+        }
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+
+    return array;
+}
+
+/**
+ * Write registered metrics in Prometheus text format
+ *
+ * @return 0 on success
+ */
+int metrics_to_text(struct buffer *buf)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&registry_lock);
+
+    size_t count = 0;
+    for (size_t g = 0; g < ngroups; g++)
+        count += groups[g].count;
+
+    struct metric *ms = malloc((count ? count : 1) * sizeof(*ms));
+    if (!ms) {
+        log_errno("malloc");
+        pthread_mutex_unlock(&registry_lock);
+        return -1;
+    }
+
+    size_t n = 0;
+    for (size_t g = 0; g < ngroups; g++)
+        for (size_t i = 0; i < groups[g].count; i++)
+            if (groups[g].metrics[i].name)
+                read_metric(&groups[g].metrics[i], &ms[n++]);
+
+    pthread_mutex_unlock(&registry_lock);
+
+    /* Samples of a family must be together */
+    ret |= buffer_puts(buf, "# HELP etestd_duration_seconds Time taken by operation.\n"
+                            "# TYPE etestd_duration_seconds histogram\n");
+    for (size_t i = 0; i < n; i++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRIC_BUCKETS - 1; b++) {
+            cumulative += ms[i].buckets[b];
+            ret |= buffer_printf(buf, "etestd_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+                                 ms[i].name, (UINT64_C(1) << b) / 1e6, cumulative);
+        }
+        ret |= buffer_printf(buf, "etestd_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+                             ms[i].name, ms[i].count);
+        ret |= buffer_printf(buf, "etestd_duration_seconds_sum{op=\"%s\"} %.9f\n",
+                             ms[i].name, ms[i].total_ns / 1e9);
+        ret |= buffer_printf(buf, "etestd_duration_seconds_count{op=\"%s\"} %" PRIu64 "\n",
+                             ms[i].name, ms[i].count);
+    }
+
+    ret |= buffer_puts(buf, "# HELP etestd_errors_total Operations that failed.\n"
+                            "# TYPE etestd_errors_total counter\n");
+    for (size_t i = 0; i < n; i++)
+        ret |= buffer_printf(buf, "etestd_errors_total{op=\"%s\"} %" PRIu64 "\n", ms[i].name, ms[i].errors);
+
+    ret |= buffer_puts(buf, "# HELP etestd_bytes_total Bytes transferred by operation.\n"
+                            "# TYPE etestd_bytes_total counter\n");
+    for (size_t i = 0; i < n; i++)
+        ret |= buffer_printf(buf, "etestd_bytes_total{op=\"%s\"} %" PRIu64 "\n", ms[i].name, ms[i].bytes);
+
+    free(ms);
+
+    return ret ? -1 : 0;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return -1;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Replace metrics file, so that readers never see it half written
+ */
+static void write_metrics_file(const char *path, const char *tmp_path)
+{
+    struct buffer buf;
+    buffer_init(&buf);
+
+    if (metrics_to_text(&buf) != 0)
+        goto out;
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        log_errno(tmp_path);
+        goto out;
+    }
+    size_t len = buffer_length(&buf);
+    int failed = fwrite(buffer_data(&buf), 1, len, fp) != len;
+    if (fclose(fp) != 0 || failed) {
+        log_errno(tmp_path);
+        unlink(tmp_path);
+        goto out;
+    }
+    if (rename(tmp_path, path) == -1)
+        log_errno(path);
+
+out:
+    buffer_free(&buf);
+}
+
+static void *file_writer_main(void *arg)
+{
+    const char *path = arg;
+    char *tmp_path;
+
+    if (asprintf(&tmp_path, "%s.tmp", path) == -1) {
+        log_msg("Out of memory\n");
+        return NULL;
+    }
+
+    for (;;) {
+        write_metrics_file(path, tmp_path);
+        sleep(METRICS_FILE_INTERVAL);
+    }
+
+    return NULL;
+}
+
+static void *socket_server_main(void *arg)
+{
+    int listen_fd = (intptr_t) arg;
+
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                log_errno("accept");
+                sleep(METRICS_SOCKET_BACKOFF);
+            }
+            continue;
+        }
+
+        /* Reader that doesn't read mustn't hold up the thread forever */
+        struct timeval timeout = { .tv_sec = METRICS_SOCKET_TIMEOUT };
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
+            log_errno("setsockopt");
+            close(fd);
+            continue;
+        }
+
+        struct buffer buf;
+        buffer_init(&buf);
+        if (metrics_to_text(&buf) == 0 &&
+            write_all(fd, buffer_data(&buf), buffer_length(&buf)) != 0 && errno != EPIPE)
+            log_errno("write");
+        buffer_free(&buf);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int start_thread(void *(*fn)(void *), void *arg)
+{
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, fn, arg);
+    if (ret != 0) {
+        log_msg("pthread_create: %s\n", strerror(ret));
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
+
+/**
+ * Start thread writing metrics to file every METRICS_FILE_INTERVAL seconds
+ *
+ * @return 0 on success
+ */
+int metrics_start_file(const char *path)
+{
+    return start_thread(file_writer_main, (void *) path);
+}
+
+/**
+ * Start thread sending metrics to every peer connecting to Unix socket
+ *
+ * Stale socket file left at path is replaced.
+ *
+ * @return 0 on success
+ */
+int metrics_start_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_msg("%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_errno("socket");
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(fd, SOMAXCONN) == -1) {
+        log_errno(path);
+        close(fd);
+        return -1;
+    }
+
+    if (start_thread(socket_server_main, (void *) (intptr_t) fd) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <json-c/json.h>
+
+struct buffer;
+
+/* Bucket i counts durations under 2^i microseconds, the last one the rest */
+#define METRIC_BUCKETS  32
+
+/**
+ * Counters of a timed operation
+ *
+ * Updated with relaxed atomics, so any thread may record without
+ * locking. Counters are read one by one, so a reader may see them
+ * slightly out of step with each other.
+ */
+struct metric {
+    const char *name;
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[METRIC_BUCKETS];
+};
+
+uint64_t metric_now(void);
+void metric_record(struct metric *m, uint64_t start, int error);
+void metric_add_bytes(struct metric *m, uint64_t bytes);
+
+void metrics_register(struct metric *metrics, size_t count);
+json_object *metrics_to_json(void);
+int metrics_to_text(struct buffer *buf);
+
+int metrics_start_file(const char *path);
+int metrics_start_socket(const char *path);
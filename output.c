@@ -0,0 +1,196 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing output queues of connections.
+ *
+ * Reply lines are copied to a buffer, but bodies taken from reply cache
+ * are queued by reference. Whole queue is then sent with a single
+ * writev, so status line, body and terminating CRLF go out together
+ * and the body is never copied in userspace.
+ *
+ * Replies too large to be held in memory are produced by a source a
+ * chunk at a time, whenever what was produced before has been sent.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "cache.h"
+#include "metrics.h"
+#include "output.h"
+
+/* Bytes source is asked to produce before they are sent */
+#define OUTPUT_CHUNK    (64 * 1024)
+
+void output_init(struct output *out)
+{
+    buffer_init(&out->buf);
+    out->refs = NULL;
+    out->refs_tail = &out->refs;
+    out->claimed = 0;
+    out->refs_len = 0;
+    out->source = NULL;
+    out->source_metric = NULL;
+}
+
+void output_free(struct output *out)
+{
+    while (out->refs) {
+        struct output_ref *ref = out->refs;
+        out->refs = ref->next;
+        cache_release(ref->body);
+        free(ref);
+    }
+    if (out->source)
+        out->source->free(out->source);
+    buffer_free(&out->buf);
+}
+
+/**
+ * Queue body after everything buffered so far
+ *
+ * Takes a reference of body on success.
+ *
+ * @return 0 on success
+ */
+int output_append_body(struct output *out, struct cache_body *body)
+{
+    struct output_ref *ref = malloc(sizeof(*ref));
+    if (!ref) {
+        log_errno("malloc");
+        return -1;
+    }
+
+    ref->next = NULL;
+    ref->prefix = buffer_length(&out->buf) - out->claimed;
+    ref->body = body;
+    ref->sent = 0;
+    __atomic_add_fetch(&body->refs, 1, __ATOMIC_RELAXED);
+
+    out->claimed += ref->prefix;
+    out->refs_len += body->len;
+    *out->refs_tail = ref;
+    out->refs_tail = &ref->next;
+
+    return 0;
+}
+
+/**
+ * Queue source after everything queued so far
+ *
+ * Queue takes ownership of source.
+ *
+ * @param metric counts bytes produced by source, may be NULL
+ */
+void output_append_source(struct output *out, struct output_source *src,
+                          struct metric *metric)
+{
+    out->source = src;
+    out->source_metric = metric;
+}
+
+/**
+ * Let source produce next chunk if most of the queue was sent
+ *
+ * @return 0 on success, -1 if source failed
+ */
+int output_fill(struct output *out)
+{
+    while (out->source && output_length(out) < OUTPUT_CHUNK) {
+        size_t len = buffer_length(&out->buf);
+        int ret = out->source->fill(out->source, &out->buf);
+        if (out->source_metric)
+            metric_add_bytes(out->source_metric, buffer_length(&out->buf) - len);
+        if (ret == 0)
+            continue;
+
+        out->source->free(out->source);
+        out->source = NULL;
+        if (ret < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Number of bytes waiting to be sent
+ *
+ * Bytes not yet produced by source aren't counted.
+ */
+size_t output_length(const struct output *out)
+{
+    return buffer_length(&out->buf) + out->refs_len;
+}
+
+/**
+ * Describe bytes waiting to be sent, in order
+ *
+ * @param max size of iov, at least 2
+ *
+ * @return number of iov entries filled in
+ */
+int output_iov(const struct output *out, struct iovec *iov, int max)
+{
+    char *data = buffer_data(&out->buf);
+    struct output_ref *ref = out->refs;
+    int n = 0;
+
+    for (; ref && n + 2 <= max; ref = ref->next) {
+        if (ref->prefix > 0) {
+            iov[n].iov_base = data;
+            iov[n].iov_len = ref->prefix;
+            n++;
+            data += ref->prefix;
+        }
+        iov[n].iov_base = ref->body->data + ref->sent;
+        iov[n].iov_len = ref->body->len - ref->sent;
+        n++;
+    }
+
+    /* bytes buffered after last body */
+    size_t rest = buffer_length(&out->buf) - out->claimed;
+    if (!ref && n < max && rest > 0) {
+        iov[n].iov_base = data;
+        iov[n].iov_len = rest;
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * Remove sent bytes from the front of queue
+ */
+void output_consume(struct output *out, size_t len)
+{
+    while (len > 0 && out->refs) {
+        struct output_ref *ref = out->refs;
+
+        size_t n = len < ref->prefix ? len : ref->prefix;
+        buffer_consume(&out->buf, n);
+        ref->prefix -= n;
+        out->claimed -= n;
+        len -= n;
+
+        n = len < ref->body->len - ref->sent ? len : ref->body->len - ref->sent;
+        ref->sent += n;
+        out->refs_len -= n;
+        len -= n;
+
+        if (ref->prefix > 0 || ref->sent < ref->body->len)
+            return;
+
+        out->refs = ref->next;
+        if (!out->refs)
+            out->refs_tail = &out->refs;
+        cache_release(ref->body);
+        free(ref);
+    }
+
+    buffer_consume(&out->buf, len);
+}
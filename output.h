@@ -0,0 +1,67 @@
+#include <stddef.h>
+#include <sys/uio.h>
+
+struct cache_body;
+struct metric;
+
+/**
+ * Cached body queued for sending without copying
+ */
+struct output_ref {
+    struct output_ref *next;
+    size_t prefix;              /* buffered bytes to be sent before body */
+    struct cache_body *body;
+    size_t sent;                /* bytes of body already sent */
+};
+
+/**
+ * Producer of reply generated while it's being sent
+ *
+ * fill appends next part of reply to buf and returns 1 once reply
+ * is complete, 0 if there is more to come or -1 on error. free
+ * releases the source.
+ */
+struct output_source {
+    int (*fill)(struct output_source *src, struct buffer *buf);
+    void (*free)(struct output_source *src);
+};
+
+/**
+ * Bytes waiting to be sent to peer
+ *
+ * Small pieces are copied to buffer, while cached bodies are only
+ * referenced. They are gathered back in order by output_iov().
+ *
+ * Queue may end with a source, which is asked for more bytes by
+ * output_fill() as the rest is sent. Nothing may be appended
+ * until the source is done.
+ */
+struct output {
+    struct buffer buf;
+    struct output_ref *refs;
+    struct output_ref **refs_tail;
+    size_t claimed;             /* buffered bytes sent before last body */
+    size_t refs_len;            /* unsent bytes of referenced bodies */
+    struct output_source *source;
+    struct metric *source_metric;
+};
+
+void output_init(struct output *out);
+void output_free(struct output *out);
+
+int output_append_body(struct output *out, struct cache_body *body);
+void output_append_source(struct output *out, struct output_source *src,
+                          struct metric *metric);
+size_t output_length(const struct output *out);
+int output_fill(struct output *out);
+
+/**
+ * Check if queue ends with a source that isn't done yet
+ */
+static inline int output_streaming(const struct output *out)
+{
+    return out->source != NULL;
+}
+
+int output_iov(const struct output *out, struct iovec *iov, int max);
+void output_consume(struct output *out, size_t len);
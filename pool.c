@@ -0,0 +1,78 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing pool of worker threads.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "pool.h"
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct work *queue_head;
+static struct work *queue_tail;
+
+static void *worker_main(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&queue_mutex);
+        while (!queue_head)
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        struct work *work = queue_head;
+        queue_head = work->next;
+        if (!queue_head)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&queue_mutex);
+
+        work->fn(work);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start worker threads
+ *
+ * @param nthreads number of threads
+ *
+ * @return 0 on success
+ */
+int pool_start(int nthreads)
+{
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t thread;
+        int ret = pthread_create(&thread, NULL, worker_main, NULL);
+        if (ret != 0) {
+            log_msg("pthread_create: %s\n", strerror(ret));
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    return 0;
+}
+
+/**
+ * Queue work for execution by one of worker threads
+ *
+ * Work items are started in submission order.
+ */
+void pool_submit(struct work *work)
+{
+    work->next = NULL;
+
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_tail)
+        queue_tail->next = work;
+    else
+        queue_head = work;
+    queue_tail = work;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+}
@@ -0,0 +1,13 @@
+/**
+ * Unit of work executed by the pool
+ *
+ * Meant to be embedded in caller's structure, so that
+ * submitting work doesn't require allocation.
+ */
+struct work {
+    void (*fn)(struct work *work);
+    struct work *next;
+};
+
+int pool_start(int nthreads);
+void pool_submit(struct work *work);
@@ -8,26 +8,180 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <json-c/json.h>
 #include <nettle/md5.h>
 #include <nettle/base16.h>
 
 #include "common.h"
+#include "buffer.h"
+#include "output.h"
 #include "protocol.h"
 #include "db.h"
+#include "cache.h"
+#include "stream.h"
+#include "compress.h"
+#include "export.h"
+#include "metrics.h"
 
 #define JSON_FLAGS  JSON_C_TO_STRING_PLAIN
 #define LINE_LEN    1024
 #define NO_AUTH     0
 
+#define DEFAULT_MAX_BODY    (16 * 1024 * 1024)
+/* Smaller replies aren't worth compressing */
+#define COMPRESS_MIN_LEN    1024
+
+/* Ids of GET TESTS FULL that fit in a request line */
+#define MAX_BATCH_IDS   (LINE_LEN / 37)
+
+static size_t max_body_size = DEFAULT_MAX_BODY;
+
+/* Requests handled so far, by request code */
+static struct metric request_metrics[] = {
+    [REQUEST_USER] =            { .name = "USER" },
+    [REQUEST_GET_TEST] =        { .name = "GET TEST" },
+    [REQUEST_GET_TESTS] =       { .name = "GET TESTS" },
+    [REQUEST_GET_USERS] =       { .name = "GET USERS" },
+    [REQUEST_GET_GROUPS] =      { .name = "GET GROUPS" },
+    [REQUEST_GET_RESULTS] =     { .name = "GET RESULTS" },
+    [REQUEST_GET_STATS] =       { .name = "GET STATS" },
+    [REQUEST_GET_METRICS] =     { .name = "GET METRICS" },
+    [REQUEST_PUT_ANSWERS] =     { .name = "PUT ANSWERS" },
+    [REQUEST_PUT_TEST] =        { .name = "PUT TEST" },
+    [REQUEST_PUT_USER] =        { .name = "PUT USER" },
+    [REQUEST_PUT_GROUPS] =      { .name = "PUT GROUPS" },
+    [REQUEST_DELETE_TEST] =     { .name = "DELETE TEST" },
+    [REQUEST_DELETE_USER] =     { .name = "DELETE USER" },
+    [REQUEST_DELETE_GROUP] =    { .name = "DELETE GROUP" },
+    [REQUEST_EXPORT_CSV] =      { .name = "EXPORT CSV" },
+    [REQUEST_EXPORT_NDJSON] =   { .name = "EXPORT NDJSON" },
+    [REQUEST_COMPRESS] =        { .name = "COMPRESS" },
+    [REQUEST_BYE] =             { .name = "BYE" }
+};
+
+/**
+ * Set largest request body accepted from peers
+ */
+void set_max_body_size(size_t size)
+{
+    max_body_size = size;
+}
+
+size_t get_max_body_size(void)
+{
+    return max_body_size;
+}
+
+/**
+ * Make metrics of requests available to reports
+ */
+void register_request_metrics(void)
+{
+    metrics_register(request_metrics, sizeof(request_metrics) / sizeof(*request_metrics));
+}
+
+/**
+ * Note start of request for its metrics
+ */
+static void start_request(int code, struct session *session)
+{
+    session->request = code;
+    session->request_start = metric_now();
+    session->request_queued = output_length(session->out);
+    session->request_failed = 0;
+}
+
+/**
+ * Record metrics of request once it's answered
+ *
+ * Requests followed by a body or authentication response are
+ * finished once that is handled, PUT ANSWERS once answers are durable.
+ * Streamed part of reply is counted as it's produced.
+ */
+static void finish_request(struct session *session)
+{
+    struct metric *m = &request_metrics[session->request];
+
+    metric_add_bytes(m, output_length(session->out) - session->request_queued);
+    metric_record(m, session->request_start, session->request_failed);
+}
+
 int has_required_auth_level(int required_auth_level, int peer_auth_level)
 {
     return required_auth_level & peer_auth_level;
 }
 
-static int send_reply(FILE *stream, int reply_type, const char *format, va_list ap)
+static void answers_committed(struct journal_waiter *commit)
+{
+    struct session *session = container_of(commit, struct session, commit);
+
+    /* Called by journal committer, not by thread serving the peer */
+    log_set_tag(session->peer, session->creds.username);
+
+    /* Output queued before may have been sent meanwhile */
+    session->request_queued = output_length(session->out);
+    send_reply_ok(session, "answers added");
+    session->state = SESSION_STATE_REQUEST;
+    finish_request(session);
+    session->resume(session);
+
+    log_set_tag(NULL, NULL);
+}
+
+/**
+ * Initialize session of newly connected peer
+ *
+ * @param peer address of peer, must outlive session
+ * @param out queue for replies to peer
+ * @param resume called when session is ready for input
+ * again after SESSION_STATE_COMMIT
+ */
+void session_init(struct session *session, const char *peer, struct output *out,
+                  void (*resume)(struct session *session))
+{
+    session->creds.username = NULL;
+    session->creds.auth_level = AUTH_LEVEL_UNAUTHORIZED;
+    session->peer = peer;
+    session->state = SESSION_STATE_REQUEST;
+    session->out = out;
+    session->auth_username = NULL;
+    session->tok = NULL;
+    session->skip_line = 0;
+    session->compress = 0;
+    session->request = REQUEST_USER;
+    session->request_start = 0;
+    session->request_queued = 0;
+    session->request_failed = 0;
+    session->commit.fn = answers_committed;
+    session->resume = resume;
+}
+
+/**
+ * Release resources held by session
+ */
+void session_destroy(struct session *session)
+{
+    free(session->creds.username);
+    free(session->auth_username);
+    if (session->tok)
+        json_tokener_free(session->tok);
+}
+
+/**
+ * Send reply to PUT ANSWERS once answers are durable
+ */
+void session_wait_for_commit(struct session *session)
+{
+    wait_for_answers_commit(&session->commit);
+}
+
+static int send_reply(struct session *session, int reply_type, const char *format, va_list ap)
 {
     const char *sig;
     
@@ -38,50 +192,64 @@ static int send_reply(FILE *stream, int reply_type, const char *format, va_list
     else
         return -EINVAL;
 
-    fputs(sig, stream);
-        
-    vfprintf(stream, format, ap);
-
-    fputs("\r\n", stream);
-
-    if (ferror(stream))
+    if (buffer_puts(&session->out->buf, sig) != 0 ||
+        buffer_vprintf(&session->out->buf, format, ap) != 0 ||
+        buffer_puts(&session->out->buf, "\r\n") != 0)
         return -EIO;
     return 0;
 }
 
-int send_reply_ok(FILE *stream, const char *format, ...)
+int send_reply_ok(struct session *session, const char *format, ...)
 {
     va_list ap;
 
     va_start(ap, format);
-    int ret = send_reply(stream, REPLY_OK, format, ap);
+    int ret = send_reply(session, REPLY_OK, format, ap);
     va_end(ap);
 
     return ret;
 }
 
-int send_reply_err(FILE *stream, const char *format, ...)
+int send_reply_err(struct session *session, const char *format, ...)
 {
     va_list ap;
 
+    session->request_failed = 1;
+
     va_start(ap, format);
-    int ret = send_reply(stream, REPLY_ERR, format, ap);
+    int ret = send_reply(session, REPLY_ERR, format, ap);
     va_end(ap);
 
     return ret;
 }
 
-int send_data(FILE *stream, const char *string)
+int send_data(struct session *session, const char *string)
 {
-    fputs(string, stream);
-    //fputs("\r\n.\r\n", stream);
-    fputs("\r\n", stream);
-    
-    if (ferror(stream))
+    if (buffer_puts(&session->out->buf, string) != 0 ||
+        buffer_puts(&session->out->buf, "\r\n") != 0)
         return -EIO;
     return 0;
 }
 
+/**
+ * Send JSON object, serializing it as it's being sent
+ *
+ * Whole reply is never held in memory. Object must be private
+ * to caller and is released.
+ */
+int send_json(struct session *session, json_object *obj)
+{
+    struct output_source *src = json_stream_new(obj, JSON_FLAGS);
+    if (!src) {
+        int ret = send_data(session, json_object_to_json_string_ext(obj, JSON_FLAGS));
+        json_object_put(obj);
+        return ret;
+    }
+
+    output_append_source(session->out, src, &request_metrics[session->request]);
+    return 0;
+}
+
 struct request_info {
     int code;
     int required_auth_level;
@@ -101,12 +269,15 @@ static const struct method_map {
     },
     {
         "GET",
-        (const char *[]) { "TEST", "TESTS", "USERS", "GROUPS", NULL },
+        (const char *[]) { "TEST", "TESTS", "USERS", "GROUPS", "RESULTS", "STATS", "METRICS", NULL },
         (struct request_info []) {
             { REQUEST_GET_TEST,     AUTH_LEVEL_STUDENT | AUTH_LEVEL_EXAMINER | AUTH_LEVEL_ADMINISTRATOR },
             { REQUEST_GET_TESTS,    AUTH_LEVEL_STUDENT | AUTH_LEVEL_EXAMINER | AUTH_LEVEL_ADMINISTRATOR },
             { REQUEST_GET_USERS,    AUTH_LEVEL_STUDENT | AUTH_LEVEL_EXAMINER | AUTH_LEVEL_ADMINISTRATOR },
-            { REQUEST_GET_GROUPS,   AUTH_LEVEL_EXAMINER | AUTH_LEVEL_ADMINISTRATOR }
+            { REQUEST_GET_GROUPS,   AUTH_LEVEL_EXAMINER | AUTH_LEVEL_ADMINISTRATOR },
+            { REQUEST_GET_RESULTS,  AUTH_LEVEL_EXAMINER | AUTH_LEVEL_ADMINISTRATOR },
+            { REQUEST_GET_STATS,    AUTH_LEVEL_EXAMINER | AUTH_LEVEL_ADMINISTRATOR },
+            { REQUEST_GET_METRICS,  AUTH_LEVEL_ADMINISTRATOR }
         }
     },
     {
@@ -128,6 +299,22 @@ static const struct method_map {
             { REQUEST_DELETE_GROUP, AUTH_LEVEL_ADMINISTRATOR }
         }
     },
+    {
+        "EXPORT",
+        (const char *[]) { "CSV", "NDJSON", NULL },
+        (struct request_info []) {
+            { REQUEST_EXPORT_CSV,       AUTH_LEVEL_EXAMINER | AUTH_LEVEL_ADMINISTRATOR },
+            { REQUEST_EXPORT_NDJSON,    AUTH_LEVEL_EXAMINER | AUTH_LEVEL_ADMINISTRATOR }
+        }
+    },
+    {
+        "COMPRESS",
+        (const char *[]) { "DEFLATE", NULL },
+        (struct request_info []) {
+            { REQUEST_COMPRESS,     AUTH_LEVEL_UNAUTHORIZED | AUTH_LEVEL_STUDENT | \
+                AUTH_LEVEL_EXAMINER | AUTH_LEVEL_ADMINISTRATOR }
+        }
+    },
     {
         "BYE",
         NULL,
@@ -190,28 +377,34 @@ static const char *auth_level_to_string(int auth_level)
     
 }
 
-int authenticate_user(const char *username, const char *password_hash, FILE *peer_stream)
+/**
+ * Send authentication challenge to peer
+ *
+ * Peer is expected to reply with MD5 digest of password hash
+ * concatenated with the nonce, which is checked by authenticate_user().
+ */
+void send_auth_challenge(const char *username, const char *password_hash, struct session *session)
 {
-#if NO_AUTH
-    return 0;
-#endif
     uuid_t nonce;
     uuid_generate_random(nonce);
     char nonce_s[37];
     uuid_unparse(nonce, nonce_s);
 
-    send_reply_ok(peer_stream, "%s", nonce_s);
-
     struct md5_ctx ctx;
     md5_init(&ctx);
     md5_update(&ctx, strlen(password_hash), (uint8_t *) password_hash);
     md5_update(&ctx, strlen(nonce_s), (uint8_t *) nonce_s);
-    uint8_t my_digest[MD5_DIGEST_SIZE];
-    md5_digest(&ctx, MD5_DIGEST_SIZE, my_digest);
+    md5_digest(&ctx, MD5_DIGEST_SIZE, session->auth_digest);
 
-    char line[LINE_LEN];
-    if (fgets(line, LINE_LEN, peer_stream) == NULL)
-        return -1;
+    free(session->auth_username);
+    session->auth_username = strdup(username);
+    session->state = SESSION_STATE_AUTH;
+
+    send_reply_ok(session, "%s", nonce_s);
+}
+
+int authenticate_user(char *line, struct session *session)
+{
     line[strcspn(line, "\r\n")] = '\0';
 
     if (strlen(line) != BASE16_ENCODE_LENGTH(MD5_DIGEST_SIZE))
@@ -223,7 +416,7 @@ int authenticate_user(const char *username, const char *password_hash, FILE *pee
     uint8_t peer_digest[MD5_DIGEST_SIZE];
     if (base16_decode_update(&decode_ctx, &dst_length, peer_digest,
         BASE16_ENCODE_LENGTH(MD5_DIGEST_SIZE), (uint8_t *) line) && base16_decode_final(&decode_ctx))
-        if (memcmp(my_digest, peer_digest, MD5_DIGEST_SIZE) == 0)
+        if (memcmp(session->auth_digest, peer_digest, MD5_DIGEST_SIZE) == 0)
             return 0;
             
     return -1;
@@ -231,107 +424,387 @@ int authenticate_user(const char *username, const char *password_hash, FILE *pee
 
 void authorize_user(const char *username, struct credentials *peer_creds)
 {
+    free(peer_creds->username);
     peer_creds->username = strdup(username);
 
-    json_object *groups = get_groups();
-
-    if (user_is_administrator(username, groups))
+    if (user_is_administrator(username))
         peer_creds->auth_level = AUTH_LEVEL_ADMINISTRATOR;
-    else if (user_is_examiner(username, groups))
+    else if (user_is_examiner(username))
         peer_creds->auth_level = AUTH_LEVEL_EXAMINER;
     else
         peer_creds->auth_level = AUTH_LEVEL_STUDENT;
+}
 
-    json_object_put(groups);
+static int greet_user(const char *username, struct session *session)
+{
+    authorize_user(username, &session->creds);
+    send_reply_ok(session, "%s Hello %s, how are you?", auth_level_to_string(session->creds.auth_level), username);
+    return 0;
 }
 
-int handle_request_user(const char *username, struct credentials *peer_creds, FILE *peer_stream)
+int handle_request_user(const char *username, struct session *session)
 {
-    json_object *users = get_users();
-    json_object *user = get_entity(username, users);
+#if NO_AUTH
+    return greet_user(username, session);
+#endif
+    json_object *user = get_user(username);
     json_object *password_hash = NULL;
 
     int ret;
     if (user &&
         json_object_object_get_ex(user, "passwordHash", &password_hash) == TRUE &&
-        json_object_is_type(password_hash, json_type_string) &&
-        authenticate_user(username, json_object_get_string(password_hash), peer_stream) == 0) {
-            authorize_user(username, peer_creds);
-            send_reply_ok(peer_stream, "%s Hello %s, how are you?", auth_level_to_string(peer_creds->auth_level), username);
+        json_object_is_type(password_hash, json_type_string)) {
+            send_auth_challenge(username, json_object_get_string(password_hash), session);
             ret = 0;
     } else {
-            send_reply_err(peer_stream, "auth error");
+            send_reply_err(session, "auth error");
             ret = -1;
     }
     
-    json_object_put(users);
+    json_object_put(user);
             
     return ret;
 }
 
-json_object *get_tests_for_user(const struct credentials *peer_creds)
+int handle_auth_response(char *line, struct session *session)
+{
+    int ret;
+
+    session->state = SESSION_STATE_REQUEST;
+
+    if (authenticate_user(line, session) == 0)
+        ret = greet_user(session->auth_username, session);
+    else {
+        send_reply_err(session, "auth error");
+        ret = -1;
+    }
+
+    free(session->auth_username);
+    session->auth_username = NULL;
+
+    /* Rest of the request is logged as the new user */
+    log_set_tag(session->peer, session->creds.username);
+    finish_request(session);
+
+    return ret;
+}
+
+json_object *get_test_for_user(uuid_t id, const struct credentials *peer_creds)
 {
     switch (peer_creds->auth_level) {
         case AUTH_LEVEL_ADMINISTRATOR:
-            return get_tests();
+            return get_test(id);
         case AUTH_LEVEL_EXAMINER:
-            return get_tests_for_examiner(peer_creds->username);
-        case AUTH_LEVEL_STUDENT:
-            return get_tests_for_student(peer_creds->username);
+            return get_test_for_examiner(id, peer_creds->username);
         default:
             abort();
     }
 }
 
-json_object *get_test_for_user(uuid_t id, const struct credentials *peer_creds, json_object *tests)
+json_object *get_tests_by_id_for_user(uuid_t *ids, size_t count, const struct credentials *peer_creds)
 {
     switch (peer_creds->auth_level) {
         case AUTH_LEVEL_ADMINISTRATOR:
+            return get_tests_by_id(ids, count, NULL);
         case AUTH_LEVEL_EXAMINER:
-            return get_test(id, tests);
-        case AUTH_LEVEL_STUDENT:
-            return get_test_for_student(id, peer_creds->username, tests);
+            return get_tests_by_id(ids, count, peer_creds->username);
         default:
             abort();
     }
 }
 
-int handle_request_get_tests(const struct credentials *peer_creds, FILE *peer_stream)
+json_object *get_results_for_user(uuid_t id, const struct credentials *peer_creds)
 {
-    json_object *tests = get_tests_for_user(peer_creds); 
-    
-    remove_qa_from_tests(tests);
-    
-    send_reply_ok(peer_stream, "");
-    send_data(peer_stream, json_object_to_json_string_ext(tests, JSON_FLAGS));
-    
-    json_object_put(tests);
-    return 0;
+    switch (peer_creds->auth_level) {
+        case AUTH_LEVEL_ADMINISTRATOR:
+            return get_results(id, NULL);
+        case AUTH_LEVEL_EXAMINER:
+            return get_results(id, peer_creds->username);
+        default:
+            abort();
+    }
+}
+
+json_object *get_test_stats_for_user(uuid_t id, const struct credentials *peer_creds)
+{
+    switch (peer_creds->auth_level) {
+        case AUTH_LEVEL_ADMINISTRATOR:
+            return get_test_stats(id, NULL);
+        case AUTH_LEVEL_EXAMINER:
+            return get_test_stats(id, peer_creds->username);
+        default:
+            abort();
+    }
 }
 
-int handle_request_get_test(uuid_t id, const struct credentials *peer_creds, FILE *peer_stream)
+/**
+ * Make key of cached reply
+ *
+ * Replies differ by role and, except for administrators, by user.
+ *
+ * @param id test id or NULL for list of tests
+ */
+static void reply_cache_key(char *key, size_t size, const struct credentials *creds, uuid_t id)
+{
+    char id_string[37] = "*";
+
+    if (id)
+        uuid_unparse(id, id_string);
+
+    snprintf(key, size, "%d\n%s\n%s", creds->auth_level,
+             creds->auth_level == AUTH_LEVEL_ADMINISTRATOR ? "" : creds->username, id_string);
+}
+
+/**
+ * Get versions of data replies to peer are made from
+ *
+ * Replies to students depend on their groups and answers too.
+ */
+static void reply_version(const struct credentials *creds, struct db_version *version)
 {
-    int ret = 0;
-    json_object *tests = get_tests_for_user(peer_creds);
-    json_object *test = get_test_for_user(id, peer_creds, tests);
+    get_db_version(creds->auth_level == AUTH_LEVEL_STUDENT ? creds->username : NULL, version);
+}
 
-    if (test) {
-        send_reply_ok(peer_stream, "");
-        send_data(peer_stream, json_object_to_json_string_ext(test, JSON_FLAGS));
+/**
+ * Send cached reply
+ *
+ * Body is queued by reference, not copied. If peer asked for it,
+ * large body is sent compressed, as "+OK DEFLATE <length>" line
+ * followed by that many bytes and CRLF.
+ */
+static void send_cached_data(struct session *session, struct cache_body *body)
+{
+    if (session->compress && body->len >= COMPRESS_MIN_LEN) {
+        struct cache_body *deflated = cache_deflated(body);
+        if (deflated) {
+            cache_release(body);
+            body = deflated;
+            send_reply_ok(session, "DEFLATE %zu", body->len);
+        } else {
+            send_reply_ok(session, "");
+        }
     } else {
-        send_reply_err(peer_stream, "not available");
-        ret = -1;
+        send_reply_ok(session, "");
     }
+    if (output_append_body(session->out, body) != 0 ||
+        buffer_puts(&session->out->buf, "\r\n") != 0)
+        log_msg("Could not send reply\n");
+    cache_release(body);
+}
 
-    json_object_put(tests);
-    return ret;
+/**
+ * Cache serialized reply and send it
+ */
+static void send_data_cached(struct session *session, const char *key, const struct db_version *version,
+                             int64_t expires, const char *data, size_t len)
+{
+    struct cache_body *body = cache_put(key, version, sizeof(*version), expires, data, len);
+    if (body) {
+        send_cached_data(session, body);
+        return;
+    }
+
+    send_reply_ok(session, "");
+    if (buffer_append(&session->out->buf, data, len) != 0 ||
+        buffer_puts(&session->out->buf, "\r\n") != 0)
+        log_msg("Could not send reply\n");
+}
+
+/**
+ * Serialize test for student, adding student's part to shared view
+ *
+ * Keys are added in the same order as in a single test or list of tests
+ * built by json-c, so replies don't change.
+ *
+ * @param single reply to GET TEST rather than GET TESTS
+ */
+static int append_student_test(struct buffer *buf, const struct student_test *st, int single)
+{
+    const char *sep = st->view_len > 2 ? "," : "";
+
+    /* view is a JSON object, its closing brace is added back below */
+    if (buffer_append(buf, st->view, st->view_len - 1) != 0)
+        return -1;
+
+    if (single && st->answers) {
+        if (buffer_printf(buf, "%s\"userAnswers\":%s", sep,
+                          json_object_to_json_string_ext(st->answers, JSON_FLAGS)) != 0)
+            return -1;
+        sep = ",";
+    }
+    if (!single && st->start_time != 0) {
+        if (buffer_printf(buf, "%s\"userStartTime\":%" PRId64, sep, st->start_time) != 0)
+            return -1;
+        sep = ",";
+    }
+    if (st->submitted) {
+        if (buffer_printf(buf, "%s\"userSubmittedAnswers\":true", sep) != 0)
+            return -1;
+        sep = ",";
+    }
+    if (single && st->start_time != 0) {
+        if (buffer_printf(buf, "%s\"userStartTime\":%" PRId64, sep, st->start_time) != 0)
+            return -1;
+    }
+
+    return buffer_puts(buf, "}");
+}
+
+static int handle_student_get_tests(const char *key, const struct db_version *version,
+                                    struct session *session)
+{
+    size_t count;
+    struct student_test *tests = get_student_tests(session->creds.username, &count);
+    if (!tests) {
+        send_reply_err(session, "server error");
+        return -1;
+    }
+
+    struct buffer body;
+    buffer_init(&body);
+
+    int err = buffer_puts(&body, "[");
+    for (size_t i = 0; i < count && !err; i++)
+        err = (i > 0 && buffer_puts(&body, ",") != 0) ||
+              append_student_test(&body, &tests[i], 0) != 0;
+    if (!err)
+        err = buffer_puts(&body, "]");
+
+    free_student_tests(tests, count);
+
+    if (err) {
+        buffer_free(&body);
+        send_reply_err(session, "server error");
+        return -1;
+    }
+
+    send_data_cached(session, key, version, 0, buffer_data(&body), buffer_length(&body));
+    buffer_free(&body);
+    return 0;
+}
+
+static int handle_student_get_test(uuid_t id, const char *key, const struct db_version *version,
+                                   struct session *session)
+{
+    struct student_test st;
+    if (get_student_test(id, session->creds.username, &st) != 0) {
+        send_reply_err(session, "not available");
+        return -1;
+    }
+
+    struct buffer body;
+    buffer_init(&body);
+
+    if (append_student_test(&body, &st, 1) != 0) {
+        free_student_test(&st);
+        buffer_free(&body);
+        send_reply_err(session, "server error");
+        return -1;
+    }
+
+    /* Correct answers are revealed to students when test ends */
+    int64_t expires = time(NULL) < st.end_time ? st.end_time : 0;
+    send_data_cached(session, key, version, expires, buffer_data(&body), buffer_length(&body));
+
+    free_student_test(&st);
+    buffer_free(&body);
+    return 0;
+}
+
+int handle_request_get_tests(struct session *session)
+{
+    char key[LINE_LEN];
+    struct db_version version;
+
+    reply_cache_key(key, sizeof(key), &session->creds, NULL);
+    reply_version(&session->creds, &version);
+
+    struct cache_body *body = cache_get(key, &version, sizeof(version));
+    if (body) {
+        send_cached_data(session, body);
+        return 0;
+    }
+
+    if (session->creds.auth_level == AUTH_LEVEL_STUDENT)
+        return handle_student_get_tests(key, &version, session);
+
+    /* Examiners only see their own tests */
+    const char *owner = session->creds.auth_level == AUTH_LEVEL_EXAMINER ?
+                        session->creds.username : NULL;
+
+    struct buffer summaries;
+    buffer_init(&summaries);
+
+    if (get_test_summaries(owner, &summaries) != 0) {
+        buffer_free(&summaries);
+        send_reply_err(session, "server error");
+        return -1;
+    }
+
+    send_data_cached(session, key, &version, 0, buffer_data(&summaries), buffer_length(&summaries));
+    buffer_free(&summaries);
+    return 0;
+}
+
+int handle_request_get_test(uuid_t id, struct session *session)
+{
+    char key[LINE_LEN];
+    struct db_version version;
+
+    reply_cache_key(key, sizeof(key), &session->creds, id);
+    reply_version(&session->creds, &version);
+
+    struct cache_body *body = cache_get(key, &version, sizeof(version));
+    if (body) {
+        send_cached_data(session, body);
+        return 0;
+    }
+
+    if (session->creds.auth_level == AUTH_LEVEL_STUDENT)
+        return handle_student_get_test(id, key, &version, session);
+
+    json_object *test = get_test_for_user(id, &session->creds);
+    if (!test) {
+        send_reply_err(session, "not available");
+        return -1;
+    }
+
+    const char *data = json_object_to_json_string_ext(test, JSON_FLAGS);
+    send_data_cached(session, key, &version, 0, data, strlen(data));
+
+    json_object_put(test);
+    return 0;
 }
 
-int handle_request_get_users(const struct credentials *peer_creds, FILE *peer_stream)
+/**
+ * Send many full tests in one reply
+ *
+ * Reply is an array with a test for each requested id, in order.
+ * Tests which aren't available to peer are replaced with null.
+ */
+int handle_request_get_tests_full(uuid_t *ids, size_t count, struct session *session)
+{
+    if (session->creds.auth_level == AUTH_LEVEL_STUDENT) {
+        send_reply_err(session, "not authorized");
+        return -1;
+    }
+
+    json_object *tests = get_tests_by_id_for_user(ids, count, &session->creds);
+    if (!tests) {
+        send_reply_err(session, "server error");
+        return -1;
+    }
+
+    send_reply_ok(session, "");
+    send_json(session, tests);
+    return 0;
+}
+
+int handle_request_get_users(struct session *session)
 {
     json_object *users = NULL;
     
-    switch (peer_creds->auth_level) {
+    switch (session->creds.auth_level) {
         case AUTH_LEVEL_ADMINISTRATOR:
         case AUTH_LEVEL_EXAMINER:
         case AUTH_LEVEL_STUDENT:
@@ -350,19 +823,17 @@ int handle_request_get_users(const struct credentials *peer_creds, FILE *peer_st
                 json_object_object_del(user, "passwordHash");
         }
 
-    send_reply_ok(peer_stream, "");
-    send_data(peer_stream, json_object_to_json_string_ext(users, JSON_FLAGS));
-
-    json_object_put(users);
+    send_reply_ok(session, "");
+    send_json(session, users);
     return 0;
     
 }
 
-int handle_request_get_groups(const struct credentials *peer_creds, FILE *peer_stream)
+int handle_request_get_groups(struct session *session)
 {
     json_object *groups = NULL;
 
-    switch (peer_creds->auth_level) {
+    switch (session->creds.auth_level) {
         case AUTH_LEVEL_ADMINISTRATOR:
         case AUTH_LEVEL_EXAMINER:
             groups = get_groups();
@@ -371,174 +842,480 @@ int handle_request_get_groups(const struct credentials *peer_creds, FILE *peer_s
             abort();
     }
 
-    send_reply_ok(peer_stream, "");
-    send_data(peer_stream, json_object_to_json_string_ext(groups, JSON_FLAGS));
+    send_reply_ok(session, "");
+    send_json(session, groups);
+    return 0;
+}
+
+/**
+ * Send scores of students who submitted answers to test
+ */
+int handle_request_get_results(uuid_t id, struct session *session)
+{
+    json_object *results = get_results_for_user(id, &session->creds);
+    if (!results) {
+        send_reply_err(session, "not available");
+        return -1;
+    }
 
-    json_object_put(groups);
+    send_reply_ok(session, "");
+    send_json(session, results);
     return 0;
 }
 
-json_object *parse_json(FILE *peer_stream)
+/**
+ * Send item statistics of test
+ */
+int handle_request_get_stats(uuid_t id, struct session *session)
 {
-    char line[LINE_LEN];
-    json_object *obj = NULL;
-    json_tokener *tok = json_tokener_new();
-    
-    do {
-        if (fgets(line, LINE_LEN, peer_stream) == NULL)
+    json_object *stats = get_test_stats_for_user(id, &session->creds);
+    if (!stats) {
+        send_reply_err(session, "not available");
+        return -1;
+    }
+
+    send_reply_ok(session, "");
+    send_json(session, stats);
+    return 0;
+}
+
+/**
+ * Send submitted answers and their scores, a row per line
+ *
+ * Rows are exported from database as they are sent. Examiners
+ * only get answers to their own tests. Export ends with an empty line.
+ *
+ * @param test_id export answers to this test only, NULL for any test
+ * @param group export tests and members of this group only, NULL for any group
+ */
+int handle_request_export(int format, uuid_t *test_id, const char *group,
+                          struct session *session)
+{
+    const char *owner;
+    switch (session->creds.auth_level) {
+        case AUTH_LEVEL_ADMINISTRATOR:
+            owner = NULL;
             break;
-        obj = json_tokener_parse_ex(tok, line, strlen(line));
-    } while (json_tokener_get_error(tok) == json_tokener_continue);
-    
-    json_tokener_free(tok);
-    
-    return obj;
+        case AUTH_LEVEL_EXAMINER:
+            owner = session->creds.username;
+            break;
+        default:
+            abort();
+    }
+
+    struct export_cursor cur;
+    if (export_cursor_init(&cur, test_id, group, owner) != 0) {
+        send_reply_err(session, "not available");
+        return -1;
+    }
+
+    struct output_source *src = export_stream_new(format, &cur, "\r\n");
+    if (!src) {
+        export_cursor_free(&cur);
+        send_reply_err(session, "export error");
+        return -1;
+    }
+
+    send_reply_ok(session, "");
+    output_append_source(session->out, src, &request_metrics[session->request]);
+    return 0;
+}
+
+/**
+ * Send metrics of requests and storage
+ */
+int handle_request_get_metrics(struct session *session)
+{
+    send_reply_ok(session, "");
+    send_json(session, metrics_to_json());
+    return 0;
 }
 
-int handle_request_put_answers(uuid_t id, const char *username, FILE *peer_stream)
+/**
+ * Prepare session for receiving JSON body of PUT request
+ *
+ * Body is parsed by handle_body_data() as it arrives, which
+ * then completes the request.
+ */
+static void expect_body(int request, uuid_t id, struct session *session)
 {
-    send_reply_ok(peer_stream, "go ahead, send me your answers");
+    session->state = SESSION_STATE_BODY;
+    session->body_request = request;
+    if (id)
+        uuid_copy(session->body_id, id);
+    else
+        uuid_clear(session->body_id);
+    if (!session->tok)
+        session->tok = json_tokener_new();
+    else
+        json_tokener_reset(session->tok);
+    session->body_len = 0;
+}
 
-    json_object *answers = parse_json(peer_stream);
+int handle_request_put_answers(uuid_t id, struct session *session)
+{
+    send_reply_ok(session, "go ahead, send me your answers");
+    expect_body(REQUEST_PUT_ANSWERS, id, session);
+    return 0;
+}
 
+int handle_body_put_answers(uuid_t id, json_object *answers, struct session *session)
+{
     if (!answers) {
-        send_reply_err(peer_stream, "input error");
+        send_reply_err(session, "input error");
         return -1;
     }
 
-    if (submit_answers(id, username, answers) != 0) {
-        send_reply_err(peer_stream, "submit error");
+    if (submit_answers(id, session->creds.username, answers, &session->commit) != 0) {
+        send_reply_err(session, "submit error");
         json_object_put(answers);
         return -1;
     }
 
-    send_reply_ok(peer_stream, "answers added");
+    /* Reply is sent by answers_committed() */
+    session->state = SESSION_STATE_COMMIT;
     return 0;
 }
 
-int handle_request_put_test(const char *username, FILE *peer_stream)
+int handle_request_put_test(struct session *session)
+{
+    send_reply_ok(session, "now send me the test");
+    expect_body(REQUEST_PUT_TEST, NULL, session);
+    return 0;
+}
+
+int handle_body_put_test(json_object *test, struct session *session)
 {
-    send_reply_ok(peer_stream, "now send me the test");
-    
-    json_object *test = parse_json(peer_stream);
-    
     if (!test) {
-        send_reply_err(peer_stream, "input error");
+        send_reply_err(session, "input error");
         return -1;
     }
 
-    if (submit_test(username, test) != 0) {
-        send_reply_err(peer_stream, "submit error");
+    if (submit_test(session->creds.username, test) != 0) {
+        send_reply_err(session, "submit error");
         json_object_put(test);
         return -1;
     }
 
-    send_reply_ok(peer_stream, "test added");
+    send_reply_ok(session, "test added");
     return 0;
 }
 
-int handle_request_put_groups(FILE *peer_stream)
+int handle_request_put_groups(struct session *session)
 {
-    send_reply_ok(peer_stream, "send me the groups");
-
-    json_object *groups = parse_json(peer_stream);
+    send_reply_ok(session, "send me the groups");
+    expect_body(REQUEST_PUT_GROUPS, NULL, session);
+    return 0;
+}
 
+int handle_body_put_groups(json_object *groups, struct session *session)
+{
     if (!groups) {
-        send_reply_err(peer_stream, "input error");
+        send_reply_err(session, "input error");
         return -1;
     }
 
-    int ret;
-    if (submit_groups(groups) == 0) {
-        send_reply_ok(peer_stream, "groups added");
-        ret = 0;
-    } else {
-        send_reply_err(peer_stream, "submit error");
-        ret = -1;
+    if (submit_groups(groups) != 0) {
+        send_reply_err(session, "submit error");
+        json_object_put(groups);
+        return -1;
     }
 
-    json_object_put(groups);
+    send_reply_ok(session, "groups added");
+    return 0;
+}
 
-    return ret;
+/**
+ * Feed part of request body to session's JSON tokener
+ *
+ * @param used set to number of bytes consumed
+ * @param obj set to parsed object (or NULL on parse error)
+ * when parsing is finished
+ *
+ * @return 1 if more input is needed, 0 if parsing is finished,
+ * -1 if body is too large
+ */
+static int parse_body(const char *data, size_t len, struct session *session,
+                      size_t *used, json_object **obj)
+{
+    size_t room = max_body_size - session->body_len;
+    size_t n = len < room ? len : room;
+    if (n > INT_MAX)
+        n = INT_MAX;
+
+    *obj = json_tokener_parse_ex(session->tok, data, n);
+    enum json_tokener_error err = json_tokener_get_error(session->tok);
+
+    if (err == json_tokener_continue) {
+        *used = n;
+        session->body_len += n;
+        return session->body_len < max_body_size ? 1 : -1;
+    }
+
+    *used = err == json_tokener_success ? (size_t) session->tok->char_offset : n;
+    return 0;
+}
+
+struct inflated_body {
+    struct session *session;
+    json_object *obj;
+    int ret;            /* of parse_body() */
+};
+
+static int parse_inflated_body(const char *chunk, size_t len, void *arg)
+{
+    struct inflated_body *ib = arg;
+    size_t used;
+
+    ib->ret = parse_body(chunk, len, ib->session, &used, &ib->obj);
+
+    return ib->ret != 1;
 }
 
-int handle_request(struct credentials *peer_creds, FILE *peer_stream)
+/**
+ * Parse optional encoding of request body following request line
+ *
+ * Body is either plain JSON or, if peer enabled compression,
+ * "DEFLATE <length>" of compressed JSON.
+ *
+ * @return 0 on success, -1 if request is invalid
+ */
+static int parse_body_encoding(char **line_ptr, struct session *session)
 {
-    char request_line[LINE_LEN];
-    if (fgets(request_line, LINE_LEN, peer_stream) == NULL)
+    const char *encoding = strtok_r(NULL, " \r\n", line_ptr);
+
+    session->body_deflated = 0;
+    if (!encoding)
+        return 0;
+
+    const char *len_string = strtok_r(NULL, " \r\n", line_ptr);
+    char *end;
+    unsigned long long len = len_string ? strtoull(len_string, &end, 10) : 0;
+
+    if (!session->compress || strcasecmp(encoding, "DEFLATE") != 0 ||
+        !len_string || *end != '\0' || len == 0) {
+        send_reply_err(session, "invalid request");
         return -1;
-    
-    char *line_ptr;
-    
-    const struct request_info *req_info = parse_request(request_line, &line_ptr);
-    if (!req_info) {
-        send_reply_err(peer_stream, "invalid request");
+    }
+    if (len > max_body_size) {
+        send_reply_err(session, "request too large");
         return -1;
     }
-        
-    if (!has_required_auth_level(req_info->required_auth_level, peer_creds->auth_level)) {
-        send_reply_err(peer_stream, "not authorized");
+
+    session->body_deflated = len;
+    return 0;
+}
+
+/**
+ * Process received part of request body
+ *
+ * Plain body is parsed incrementally from raw bytes, so it may arrive
+ * in pieces of any size. Compressed body is parsed once all of it has
+ * arrived. When body is complete the rest of its last line is ignored
+ * and request is handled.
+ *
+ * @param used set to number of bytes consumed, 0 if more are needed
+ *
+ * @return 0 if session should continue, -1 if connection should be
+ * closed once pending replies are sent
+ */
+int handle_body_data(const char *data, size_t len, struct session *session, size_t *used)
+{
+    json_object *obj;
+    int ret;
+
+    if (session->body_deflated > 0) {
+        if (len < session->body_deflated) {
+            *used = 0;
+            return 0;
+        }
+
+        struct inflated_body ib = { session, NULL, 1 };
+        inflate_data(data, session->body_deflated, parse_inflated_body, &ib);
+        *used = session->body_deflated;
+        /* Incomplete or invalid data is an input error */
+        ret = ib.ret == 1 ? 0 : ib.ret;
+        obj = ib.ret == 0 ? ib.obj : NULL;
+    } else {
+        ret = parse_body(data, len, session, used, &obj);
+        if (ret == 1)
+            return 0;
+    }
+
+    session->state = SESSION_STATE_REQUEST;
+
+    if (ret < 0) {
+        send_reply_err(session, "request too large");
+        finish_request(session);
         return -1;
     }
-    
-    switch (req_info->code) {
+
+    session->skip_line = 1;
+
+    switch (session->body_request) {
+        case REQUEST_PUT_ANSWERS:
+            ret = handle_body_put_answers(session->body_id, obj, session);
+            break;
+        case REQUEST_PUT_TEST:
+            ret = handle_body_put_test(obj, session);
+            break;
+        case REQUEST_PUT_GROUPS:
+            ret = handle_body_put_groups(obj, session);
+            break;
+        default:
+            abort();
+    }
+
+    if (session->state == SESSION_STATE_REQUEST)
+        finish_request(session);
+
+    return ret;
+}
+
+static int dispatch_request(int code, char *line_ptr, struct session *session)
+{
+    switch (code) {
         case REQUEST_USER:
         {
             const char *username = strtok_r(NULL, " \r\n", &line_ptr);
             if (!username) {
-                send_reply_err(peer_stream, "invalid request");
+                send_reply_err(session, "invalid request");
                 return -1;
             }
-            return handle_request_user(username, peer_creds, peer_stream);
+            return handle_request_user(username, session);
         }
         
         case REQUEST_GET_TESTS:
-            return handle_request_get_tests(peer_creds, peer_stream);
+        {
+            const char *arg = strtok_r(NULL, " \r\n", &line_ptr);
+            if (!arg)
+                return handle_request_get_tests(session);
+            if (strcasecmp(arg, "FULL") != 0) {
+                send_reply_err(session, "invalid request");
+                return -1;
+            }
+
+            /* GET TESTS FULL <uuid>... */
+            uuid_t ids[MAX_BATCH_IDS];
+            size_t count = 0;
+            const char *id_string;
+            while ((id_string = strtok_r(NULL, " \r\n", &line_ptr))) {
+                if (count == MAX_BATCH_IDS || uuid_parse(id_string, ids[count]) != 0) {
+                    send_reply_err(session, "invalid request");
+                    return -1;
+                }
+                count++;
+            }
+            if (count == 0) {
+                send_reply_err(session, "invalid request");
+                return -1;
+            }
+
+            return handle_request_get_tests_full(ids, count, session);
+        }
         
         case REQUEST_GET_TEST:
         {
             const char *id_string = strtok_r(NULL, " \r\n", &line_ptr);
             uuid_t id;
             if (!id_string || uuid_parse(id_string, id) != 0) {
-                send_reply_err(peer_stream, "invalid request");
+                send_reply_err(session, "invalid request");
                 return -1;
             }
             
-            return handle_request_get_test(id, peer_creds, peer_stream);
+            return handle_request_get_test(id, session);
         }
         
         case REQUEST_GET_USERS:
-            return handle_request_get_users(peer_creds, peer_stream);
+            return handle_request_get_users(session);
             
         case REQUEST_GET_GROUPS:
-            return handle_request_get_groups(peer_creds, peer_stream);
+            return handle_request_get_groups(session);
+
+        case REQUEST_GET_METRICS:
+            return handle_request_get_metrics(session);
+
+        case REQUEST_GET_RESULTS:
+        {
+            const char *id_string = strtok_r(NULL, " \r\n", &line_ptr);
+            uuid_t id;
+            if (!id_string || uuid_parse(id_string, id) != 0) {
+                send_reply_err(session, "invalid request");
+                return -1;
+            }
+
+            return handle_request_get_results(id, session);
+        }
+
+        case REQUEST_GET_STATS:
+        {
+            const char *id_string = strtok_r(NULL, " \r\n", &line_ptr);
+            uuid_t id;
+            if (!id_string || uuid_parse(id_string, id) != 0) {
+                send_reply_err(session, "invalid request");
+                return -1;
+            }
+
+            return handle_request_get_stats(id, session);
+        }
         
         case REQUEST_PUT_ANSWERS:
         {
             const char *id_string = strtok_r(NULL, " \r\n", &line_ptr);
             uuid_t id;
             if (!id_string || uuid_parse(id_string, id) != 0) {
-                send_reply_err(peer_stream, "invalid request");
+                send_reply_err(session, "invalid request");
                 return -1;
             }
+            if (parse_body_encoding(&line_ptr, session) != 0)
+                return -1;
             
-            return handle_request_put_answers(id, peer_creds->username, peer_stream);
+            return handle_request_put_answers(id, session);
         }
         
         case REQUEST_PUT_TEST:
-            return handle_request_put_test(peer_creds->username, peer_stream);
+            if (parse_body_encoding(&line_ptr, session) != 0)
+                return -1;
+            return handle_request_put_test(session);
             
         case REQUEST_PUT_GROUPS:
-            return handle_request_put_groups(peer_stream);
+            if (parse_body_encoding(&line_ptr, session) != 0)
+                return -1;
+            return handle_request_put_groups(session);
+
+        case REQUEST_EXPORT_CSV:
+        case REQUEST_EXPORT_NDJSON:
+        {
+            /* EXPORT <format> [TEST <uuid> | GROUP <name>] */
+            int format = code == REQUEST_EXPORT_CSV ? EXPORT_CSV : EXPORT_NDJSON;
+            const char *scope = strtok_r(NULL, " \r\n", &line_ptr);
+            const char *arg = scope ? strtok_r(NULL, " \r\n", &line_ptr) : NULL;
+            uuid_t id;
+
+            if (!scope)
+                return handle_request_export(format, NULL, NULL, session);
+            if (arg && strcasecmp(scope, "TEST") == 0 && uuid_parse(arg, id) == 0)
+                return handle_request_export(format, &id, NULL, session);
+            if (arg && strcasecmp(scope, "GROUP") == 0)
+                return handle_request_export(format, NULL, arg, session);
+
+            send_reply_err(session, "invalid request");
+            return -1;
+        }
+
+        case REQUEST_COMPRESS:
+            session->compress = 1;
+            send_reply_ok(session, "deflate enabled");
+            return 0;
             
         case REQUEST_PUT_USER:
         case REQUEST_DELETE_TEST:
         case REQUEST_DELETE_USER:
         case REQUEST_DELETE_GROUP:
-            send_reply_err(peer_stream, "not implemented");
+            send_reply_err(session, "not implemented");
             return 0;
         case REQUEST_BYE:
-            send_reply_ok(peer_stream, "bye-bye");
+            send_reply_ok(session, "bye-bye");
             return -1;
         default:
             abort();
@@ -546,3 +1323,53 @@ int handle_request(struct credentials *peer_creds, FILE *peer_stream)
 
     return 0;
 }
+
+int handle_request(char *request_line, struct session *session)
+{
+    char *line_ptr;
+    
+    const struct request_info *req_info = parse_request(request_line, &line_ptr);
+    if (!req_info) {
+        send_reply_err(session, "invalid request");
+        return -1;
+    }
+        
+    if (!has_required_auth_level(req_info->required_auth_level, session->creds.auth_level)) {
+        send_reply_err(session, "not authorized");
+        return -1;
+    }
+
+    start_request(req_info->code, session);
+    log_msg_at(LOG_LEVEL_DEBUG, "%s\n", request_metrics[req_info->code].name);
+
+    int ret = dispatch_request(req_info->code, line_ptr, session);
+
+    if (session->state == SESSION_STATE_REQUEST)
+        finish_request(session);
+
+    return ret;
+}
+
+/**
+ * Process a line of input from peer
+ *
+ * Depending on session state the line is treated as a request or
+ * a response to authentication challenge. Replies are appended to
+ * session's output queue.
+ *
+ * @warning Modifies line
+ *
+ * @return 0 if session should continue, -1 if connection should be
+ * closed once pending replies are sent
+ */
+int handle_input_line(char *line, struct session *session)
+{
+    switch (session->state) {
+        case SESSION_STATE_REQUEST:
+            return handle_request(line, session);
+        case SESSION_STATE_AUTH:
+            return handle_auth_response(line, session);
+        default:
+            abort();
+    }
+}
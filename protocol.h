@@ -1,4 +1,11 @@
-#include <stdio.h>
+#include <stdint.h>
+#include <json-c/json.h>
+#include <uuid/uuid.h>
+#include <nettle/md5.h>
+
+#include "journal.h"
+
+struct output;
 
 enum {
     AUTH_LEVEL_UNAUTHORIZED =   0x1,
@@ -13,6 +20,9 @@ enum {
     REQUEST_GET_TESTS,
     REQUEST_GET_USERS,
     REQUEST_GET_GROUPS,
+    REQUEST_GET_RESULTS,
+    REQUEST_GET_STATS,
+    REQUEST_GET_METRICS,
     REQUEST_PUT_ANSWERS,
     REQUEST_PUT_TEST,
     REQUEST_PUT_USER,
@@ -20,6 +30,9 @@ enum {
     REQUEST_DELETE_TEST,
     REQUEST_DELETE_USER,
     REQUEST_DELETE_GROUP,
+    REQUEST_EXPORT_CSV,
+    REQUEST_EXPORT_NDJSON,
+    REQUEST_COMPRESS,
     REQUEST_BYE
 };
 
@@ -28,13 +41,70 @@ enum {
     REPLY_ERR
 };
 
+/* What the session expects as next line of input */
+enum {
+    SESSION_STATE_REQUEST,  /* request line */
+    SESSION_STATE_AUTH,     /* response to authentication challenge */
+    SESSION_STATE_BODY,     /* JSON body of PUT request */
+    SESSION_STATE_COMMIT    /* nothing, waiting for submitted answers to be durable */
+};
+
 struct credentials {
     char *username;
     int auth_level;
 };
 
-int send_reply_ok(FILE *stream, const char *format, ...);
+/**
+ * Protocol state of a single peer
+ *
+ * Replies are appended to out, which is owned by the caller.
+ *
+ * In SESSION_STATE_COMMIT the caller must stop feeding input and call
+ * session_wait_for_commit() once it's done with the session. The reply
+ * is appended from another thread, which then calls resume.
+ */
+struct session {
+    struct credentials creds;
+    const char *peer;       /* address of peer for log messages */
+    int state;
+    struct output *out;
+    int compress;           /* peer accepts compressed replies */
+
+    /* Metrics of request being handled */
+    int request;            /* request code */
+    uint64_t request_start;
+    size_t request_queued;  /* output queued before request */
+    int request_failed;     /* error reply was sent */
+
+    /* SESSION_STATE_AUTH */
+    char *auth_username;
+    uint8_t auth_digest[MD5_DIGEST_SIZE];
+
+    /* SESSION_STATE_BODY */
+    int body_request;
+    uuid_t body_id;
+    json_tokener *tok;
+    size_t body_len;        /* bytes of body received so far */
+    size_t body_deflated;   /* length of compressed body, 0 if plain */
+    int skip_line;          /* rest of line after body is to be ignored */
+
+    /* SESSION_STATE_COMMIT */
+    struct journal_waiter commit;
+    void (*resume)(struct session *session);
+};
+
+void session_init(struct session *session, const char *peer, struct output *out,
+                  void (*resume)(struct session *session));
+void session_destroy(struct session *session);
+void session_wait_for_commit(struct session *session);
+
+int send_reply_ok(struct session *session, const char *format, ...);
+
+int send_reply_err(struct session *session, const char *format, ...);
 
-int send_reply_err(FILE *stream, const char *format, ...);
+int handle_input_line(char *line, struct session *session);
+int handle_body_data(const char *data, size_t len, struct session *session, size_t *used);
 
-int handle_request(struct credentials *peer_creds, FILE *peer_stream);
+void set_max_body_size(size_t size);
+size_t get_max_body_size(void);
+void register_request_metrics(void);
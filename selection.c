@@ -0,0 +1,82 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing packed selections of multiple choice answers.
+ *
+ * Peers send a selection as an array of booleans, one per option.
+ * Stored answers hold it packed into a single integer instead, with
+ * bit i set if option i is selected. Whole selections are then
+ * compared as machine words.
+ */
+
+#include <stdio.h>
+
+#include "common.h"
+#include "selection.h"
+
+/**
+ * Get selection of options sent by peer as a bit mask
+ *
+ * Selection must be an array of booleans.
+ *
+ * @param options number of options of question
+ *
+ * @return 0 on success, -1 if selection doesn't fit the question
+ * or has too many options to be packed
+ */
+int selection_mask(json_object *selection, size_t options, uint64_t *mask)
+{
+    if (options > SELECTION_MAX_OPTIONS ||
+        !json_object_is_type(selection, json_type_array) ||
+        json_object_array_length(selection) != options)
+        return -1;
+
+    *mask = 0;
+    for (size_t i = 0; i < options; i++) {
+        json_object *selected = json_object_array_get_idx(selection, i);
+        if (!json_object_is_type(selected, json_type_boolean))
+            return -1;
+        if (json_object_get_boolean(selected))
+            *mask |= (uint64_t) 1 << i;
+    }
+
+    return 0;
+}
+
+/**
+ * Get stored selection of options as a bit mask
+ *
+ * Selection may be either packed or an array of booleans. Only
+ * for selections read from database, see selection_mask().
+ *
+ * @return 0 on success, -1 if selection doesn't fit the question
+ * or has too many options to be packed
+ */
+int selection_mask_stored(json_object *selection, size_t options, uint64_t *mask)
+{
+    if (!json_object_is_type(selection, json_type_int))
+        return selection_mask(selection, options, mask);
+
+    int64_t value = json_object_get_int64(selection);
+    if (options > SELECTION_MAX_OPTIONS || value < 0 || (uint64_t) value >> options != 0)
+        return -1;
+    *mask = value;
+
+    return 0;
+}
+
+/**
+ * Make array of booleans from packed selection
+ */
+/* allocates memory! */
+json_object *selection_unpack(uint64_t mask, size_t options)
+{
+    json_object *selection = json_object_new_array();
+
+    for (size_t i = 0; selection && i < options; i++)
+        json_object_array_add(selection, json_object_new_boolean((mask >> i) & 1));
+
+    return selection;
+}
@@ -0,0 +1,9 @@
+#include <stdint.h>
+#include <json-c/json.h>
+
+/* Selections of up to this many options are packed into one word */
+#define SELECTION_MAX_OPTIONS   63
+
+int selection_mask(json_object *selection, size_t options, uint64_t *mask);
+int selection_mask_stored(json_object *selection, size_t options, uint64_t *mask);
+json_object *selection_unpack(uint64_t mask, size_t options);
@@ -0,0 +1,447 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing event-driven connection handling.
+ *
+ * All sockets are non-blocking and multiplexed with epoll. Each connection
+ * keeps its input buffer, output queue and protocol session on the heap, so
+ * a peer that is slow or idle never holds up the others.
+ *
+ * Main thread only waits for events and accepts connections. Ready
+ * connections are serviced by worker pool. Connections are registered
+ * with EPOLLONESHOT, so a connection is owned by at most one worker
+ * until it is re-armed.
+ *
+ * Peers may pipeline requests. Each service pass handles every complete
+ * request line already received and flushes all replies at once. Input
+ * is only paused while a peer leaves too many replies uncollected, or
+ * while it sent more than a whole request body that isn't handled yet.
+ *
+ * While a session waits for submitted answers to become durable, its
+ * connection is not armed at all. It's handed back to the pool by
+ * resume_connection() once the reply is ready.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "output.h"
+#include "protocol.h"
+#include "pool.h"
+#include "server.h"
+
+#define MAX_EVENTS      64
+#define LINE_LEN        1024
+#define READ_CHUNK      4096
+/* Pieces of output passed to a single writev */
+#define WRITE_IOV       16
+/* Stop reading requests from peer that doesn't collect its replies */
+#define OUT_HIGH_WATER  (1024 * 1024)
+
+struct connection {
+    int fd;
+    char peer[NI_MAXHOST + NI_MAXSERV + 4];    /* address for log messages */
+    int closing;            /* close once output is flushed */
+    int input_closed;       /* peer won't send more requests */
+    int registered;         /* fd was added to epoll set */
+    uint32_t ready_events;  /* events to be serviced by worker */
+    struct work work;
+    struct buffer in;
+    struct output out;
+    struct session session;
+};
+
+static int epoll_fd;
+static const char *server_greeting;
+
+static void service_work(struct work *work);
+static void resume_connection(struct session *session);
+
+static struct connection *create_connection(int fd, const struct sockaddr *addr, socklen_t addr_len)
+{
+    struct connection *conn = malloc(sizeof(*conn));
+    if (!conn) {
+        log_errno("malloc");
+        return NULL;
+    }
+
+    char host[NI_MAXHOST], serv[NI_MAXSERV];
+    if (getnameinfo(addr, addr_len, host, sizeof(host), serv, sizeof(serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        snprintf(conn->peer, sizeof(conn->peer), "[%s]:%s", host, serv);
+    else
+        strcpy(conn->peer, "[unknown]");
+
+    conn->fd = fd;
+    conn->closing = 0;
+    conn->input_closed = 0;
+    conn->registered = 0;
+    conn->work.fn = service_work;
+    buffer_init(&conn->in);
+    output_init(&conn->out);
+    session_init(&conn->session, conn->peer, &conn->out, resume_connection);
+
+    return conn;
+}
+
+/**
+ * Check if more input should be read from peer
+ *
+ * Unprocessed input is kept to a request body and a line after it.
+ */
+static int can_read(struct connection *conn)
+{
+    return !conn->closing && !conn->input_closed &&
+           output_length(&conn->out) < OUT_HIGH_WATER && !output_streaming(&conn->out) &&
+           buffer_length(&conn->in) < get_max_body_size() + LINE_LEN;
+}
+
+static void destroy_connection(struct connection *conn)
+{
+    /* closing fd removes it from epoll set */
+    close(conn->fd);
+    session_destroy(&conn->session);
+    buffer_free(&conn->in);
+    output_free(&conn->out);
+    free(conn);
+}
+
+/**
+ * Re-arm connection for events it is currently able to handle
+ *
+ * Connection must not be touched after this call, as it may
+ * already be serviced by another worker.
+ */
+static int update_events(struct connection *conn)
+{
+    uint32_t events = EPOLLONESHOT;
+
+    /* Hangup is only of interest while reading, it would keep waking
+     * connection that can't make progress otherwise */
+    if (can_read(conn))
+        events |= EPOLLIN | EPOLLRDHUP;
+    if (output_length(&conn->out) > 0 || output_streaming(&conn->out))
+        events |= EPOLLOUT;
+
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    int op = conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    conn->registered = 1;
+    if (epoll_ctl(epoll_fd, op, conn->fd, &ev) == -1) {
+        log_errno("epoll_ctl");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Read everything available from socket to input buffer
+ *
+ * Stops early once input buffer is full, see can_read().
+ *
+ * @return 0 on success, 1 if peer closed connection, -1 on error
+ */
+static int read_input(struct connection *conn)
+{
+    size_t limit = get_max_body_size() + LINE_LEN;
+
+    while (buffer_length(&conn->in) < limit) {
+        if (buffer_reserve(&conn->in, READ_CHUNK) != 0)
+            return -1;
+
+        size_t room = buffer_tail_room(&conn->in);
+        if (room > limit - buffer_length(&conn->in))
+            room = limit - buffer_length(&conn->in);
+
+        ssize_t n = read(conn->fd, buffer_tail(&conn->in), room);
+        if (n > 0) {
+            conn->in.len += n;
+            continue;
+        }
+        if (n == 0)
+            return 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (errno != ECONNRESET)
+            log_errno("read");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Write as much of output queue as socket accepts
+ *
+ * Buffered replies and cached bodies are gathered by writev. Streamed
+ * reply is produced only as fast as socket takes it.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int flush_output(struct connection *conn)
+{
+    for (;;) {
+        if (output_fill(&conn->out) != 0)
+            return -1;
+        if (output_length(&conn->out) == 0)
+            break;
+
+        struct iovec iov[WRITE_IOV];
+        int iovcnt = output_iov(&conn->out, iov, WRITE_IOV);
+
+        ssize_t n = writev(conn->fd, iov, iovcnt);
+        if (n >= 0) {
+            output_consume(&conn->out, n);
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (errno != EPIPE && errno != ECONNRESET)
+            log_errno("writev");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Pass input buffer to the protocol
+ *
+ * All requests already received are handled in one pass, so replies
+ * to pipelined requests are sent together and in order. Request lines
+ * must fit in LINE_LEN, while request bodies are passed as they are,
+ * however much of them has arrived.
+ *
+ * @return 1 if stopped because output queue is full or reply is being
+ * streamed, 0 otherwise
+ */
+static int process_input(struct connection *conn)
+{
+    while (!conn->closing && conn->session.state != SESSION_STATE_COMMIT) {
+        if (output_length(&conn->out) >= OUT_HIGH_WATER ||
+            output_streaming(&conn->out))
+            return 1;
+
+        char *data = buffer_data(&conn->in);
+        size_t avail = buffer_length(&conn->in);
+        size_t len;
+
+        if (avail == 0)
+            break;
+
+        if (conn->session.state == SESSION_STATE_BODY) {
+            if (handle_body_data(data, avail, &conn->session, &len) != 0)
+                conn->closing = 1;
+            if (len == 0)
+                break;
+            buffer_consume(&conn->in, len);
+            continue;
+        }
+
+        if (conn->session.skip_line) {
+            char *newline = memchr(data, '\n', avail);
+            len = newline ? (size_t) (newline - data + 1) : avail;
+            conn->session.skip_line = !newline;
+            buffer_consume(&conn->in, len);
+            continue;
+        }
+
+        char *newline = memchr(data, '\n', avail < LINE_LEN - 1 ? avail : LINE_LEN - 1);
+        if (newline) {
+            len = newline - data + 1;
+        } else if (avail >= LINE_LEN - 1) {
+            send_reply_err(&conn->session, "request too long");
+            conn->closing = 1;
+            break;
+        } else {
+            break;
+        }
+
+        char line[LINE_LEN];
+        memcpy(line, data, len);
+        line[len] = '\0';
+        buffer_consume(&conn->in, len);
+
+        if (handle_input_line(line, &conn->session) != 0)
+            conn->closing = 1;
+    }
+
+    return 0;
+}
+
+static void accept_connections(int listen_fd)
+{
+    for (;;) {
+        struct sockaddr_storage peer_addr;
+        socklen_t peer_addr_len = sizeof(struct sockaddr_storage);
+        int peer_fd = accept4(listen_fd, (struct sockaddr *) &peer_addr, &peer_addr_len,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (peer_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /* e.g. EMFILE, retry on next event */
+            log_errno("Failed to accept connection");
+            return;
+        }
+
+        struct connection *conn = create_connection(peer_fd, (struct sockaddr *) &peer_addr,
+                                                    peer_addr_len);
+        if (!conn) {
+            close(peer_fd);
+            continue;
+        }
+
+        send_reply_ok(&conn->session, "%s", server_greeting);
+        if (flush_output(conn) != 0 || update_events(conn) != 0)
+            destroy_connection(conn);
+    }
+}
+
+static void service_connection(struct connection *conn, uint32_t events)
+{
+    if (events & EPOLLERR) {
+        destroy_connection(conn);
+        return;
+    }
+
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && can_read(conn)) {
+        int ret = read_input(conn);
+        if (ret < 0) {
+            destroy_connection(conn);
+            return;
+        }
+        conn->input_closed = ret;
+    }
+
+    /*
+     * Requests left in input buffer when output queue filled up are
+     * handled as soon as it drains. No more input may arrive to
+     * trigger it.
+     */
+    for (;;) {
+        int full = process_input(conn);
+
+        if (conn->session.state == SESSION_STATE_COMMIT) {
+            /* Error is dealt with after resume */
+            if (flush_output(conn) != 0)
+                conn->closing = 1;
+            session_wait_for_commit(&conn->session);
+            return;
+        }
+
+        if (flush_output(conn) != 0) {
+            destroy_connection(conn);
+            return;
+        }
+
+        if (!full || output_length(&conn->out) >= OUT_HIGH_WATER ||
+            output_streaming(&conn->out))
+            break;
+    }
+
+    /* Requests received before end of input are still answered */
+    if (conn->input_closed)
+        conn->closing = 1;
+
+    if (conn->closing && output_length(&conn->out) == 0 &&
+        !output_streaming(&conn->out)) {
+        destroy_connection(conn);
+        return;
+    }
+
+    if (update_events(conn) != 0)
+        destroy_connection(conn);
+}
+
+static void service_work(struct work *work)
+{
+    struct connection *conn = container_of(work, struct connection, work);
+
+    /* Connection may be gone after service_connection() */
+    log_set_tag(conn->peer, conn->session.creds.username);
+    service_connection(conn, conn->ready_events);
+    log_set_tag(NULL, NULL);
+}
+
+/**
+ * Service connection again once its session is ready for input
+ *
+ * Buffered input is processed without waiting for more to arrive.
+ */
+static void resume_connection(struct session *session)
+{
+    struct connection *conn = container_of(session, struct connection, session);
+
+    conn->ready_events = 0;
+    pool_submit(&conn->work);
+}
+
+/**
+ * Run event loop serving peers connecting to listening socket
+ *
+ * @param listen_fd listening socket
+ * @param greeting text of the welcome reply
+ * @param nworkers number of worker threads
+ *
+ * @return -1 on error, does not return otherwise
+ */
+int run_server(int listen_fd, const char *greeting, int nworkers)
+{
+    server_greeting = greeting;
+
+    if (pool_start(nworkers) != 0)
+        return -1;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        log_errno("epoll_create1");
+        return -1;
+    }
+
+    /* listening socket is marked by NULL data pointer */
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        log_errno("epoll_ctl");
+        return -1;
+    }
+
+    for (;;) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            log_errno("epoll_wait");
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_connections(listen_fd);
+            else {
+                struct connection *conn = events[i].data.ptr;
+                conn->ready_events = events[i].events;
+                pool_submit(&conn->work);
+            }
+        }
+    }
+}
@@ -0,0 +1 @@
+int run_server(int listen_fd, const char *greeting, int nworkers);
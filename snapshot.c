@@ -0,0 +1,329 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing crash-safe writes of database files.
+ *
+ * New contents are written to a temporary file, synced and renamed over
+ * the original, so a crash or full disk leaves either the old or the new
+ * file, never a truncated one. Writes can be left to a background thread,
+ * which only ever writes the latest contents of each file. Contents can
+ * also be rendered by that thread, from an object handed over to it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "metrics.h"
+#include "snapshot.h"
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_idle = PTHREAD_COND_INITIALIZER;
+static struct snapshot *queue;
+static int writing;
+
+/* Writes of all snapshots, in foreground or background */
+static struct metric write_metric = { .name = "snapshot write" };
+
+/**
+ * @return 0 on success
+ */
+int snapshot_init(struct snapshot *snapshot, const char *path)
+{
+    snapshot->path = strdup(path);
+    if (!snapshot->path) {
+        log_errno("strdup");
+        return -1;
+    }
+
+    snapshot->fatal = 1;
+    snapshot->render = NULL;
+    snapshot->release = NULL;
+    snapshot->pending = NULL;
+    snapshot->pending_obj = NULL;
+    snapshot->queued = 0;
+    snapshot->next = NULL;
+
+    return 0;
+}
+
+/**
+ * Caller must hold writer lock, unless writer isn't running
+ */
+static void drop_pending(struct snapshot *snapshot)
+{
+    free(snapshot->pending);
+    snapshot->pending = NULL;
+    if (snapshot->pending_obj)
+        snapshot->release(snapshot->pending_obj);
+    snapshot->pending_obj = NULL;
+}
+
+void snapshot_destroy(struct snapshot *snapshot)
+{
+    free(snapshot->path);
+    drop_pending(snapshot);
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return -1;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Make rename of file durable
+ */
+static int sync_parent_dir(const char *path)
+{
+    char *path_copy = strdup(path);
+    if (!path_copy) {
+        log_errno("strdup");
+        return -1;
+    }
+
+    const char *dir = dirname(path_copy);
+    int ret = 0;
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || fsync(fd) == -1) {
+        log_errno((char *) dir);
+        ret = -1;
+    }
+    if (fd != -1)
+        close(fd);
+
+    free(path_copy);
+    return ret;
+}
+
+static int replace_file(struct snapshot *snapshot, const char *data, size_t len)
+{
+    char *tmp_path;
+    if (asprintf(&tmp_path, "%s.tmp", snapshot->path) == -1) {
+        log_msg("Out of memory\n");
+        return -1;
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        log_errno(tmp_path);
+        goto err_open;
+    }
+
+    if (write_all(fd, data, len) != 0 || fsync(fd) == -1) {
+        log_errno(tmp_path);
+        goto err_write;
+    }
+
+    if (close(fd) == -1) {
+        log_errno(tmp_path);
+        goto err_close;
+    }
+
+    if (rename(tmp_path, snapshot->path) == -1) {
+        log_errno(snapshot->path);
+        goto err_close;
+    }
+
+    free(tmp_path);
+    return sync_parent_dir(snapshot->path);
+
+/* stack unwind cleanup */
+err_write:
+    close(fd);
+err_close:
+    unlink(tmp_path);
+err_open:
+    free(tmp_path);
+    return -1;
+}
+
+/**
+ * Replace file with data
+ *
+ * Returns after new contents are durable.
+ *
+ * @return 0 on success
+ */
+int snapshot_write(struct snapshot *snapshot, const char *data, size_t len)
+{
+    uint64_t start = metric_now();
+
+    int ret = replace_file(snapshot, data, len);
+
+    metric_add_bytes(&write_metric, len);
+    metric_record(&write_metric, start, ret != 0);
+
+    return ret;
+}
+
+/**
+ * Caller must hold writer lock
+ */
+static void queue_snapshot(struct snapshot *snapshot)
+{
+    if (!snapshot->queued) {
+        snapshot->queued = 1;
+        snapshot->next = queue;
+        queue = snapshot;
+        pthread_cond_signal(&writer_queued);
+    }
+}
+
+/**
+ * Replace file with data in background
+ *
+ * Data is copied, so caller may release it right away. If previous
+ * contents haven't been written yet, they are skipped. If writing fails,
+ * process is ended unless fatal flag of snapshot was cleared.
+ *
+ * @return 0 on success
+ */
+int snapshot_schedule(struct snapshot *snapshot, const char *data, size_t len)
+{
+    char *copy = malloc(len);
+    if (!copy) {
+        log_errno("malloc");
+        return -1;
+    }
+    memcpy(copy, data, len);
+
+    pthread_mutex_lock(&writer_lock);
+
+    drop_pending(snapshot);
+    snapshot->pending = copy;
+    snapshot->pending_len = len;
+    queue_snapshot(snapshot);
+
+    pthread_mutex_unlock(&writer_lock);
+
+    return 0;
+}
+
+/**
+ * Replace file with contents rendered from object in background
+ *
+ * Writer thread takes ownership of object and renders it with render
+ * callback of snapshot, so caller must not use it any more. If previous
+ * object hasn't been rendered yet, it's released and skipped.
+ */
+void snapshot_schedule_object(struct snapshot *snapshot, void *obj)
+{
+    pthread_mutex_lock(&writer_lock);
+
+    drop_pending(snapshot);
+    snapshot->pending_obj = obj;
+    queue_snapshot(snapshot);
+
+    pthread_mutex_unlock(&writer_lock);
+}
+
+/**
+ * Render object and replace file with it
+ *
+ * @return 0 on success
+ */
+static int write_object(struct snapshot *snapshot, void *obj)
+{
+    struct buffer buf;
+
+    buffer_init(&buf);
+    int ret = snapshot->render(obj, &buf);
+    snapshot->release(obj);
+    if (ret == 0)
+        ret = snapshot_write(snapshot, buffer_data(&buf), buffer_length(&buf));
+    buffer_free(&buf);
+
+    return ret;
+}
+
+static void *writer_main(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&writer_lock);
+        while (!queue)
+            pthread_cond_wait(&writer_queued, &writer_lock);
+
+        struct snapshot *snapshot = queue;
+        queue = snapshot->next;
+        snapshot->queued = 0;
+        char *data = snapshot->pending;
+        size_t len = snapshot->pending_len;
+        void *obj = snapshot->pending_obj;
+        snapshot->pending = NULL;
+        snapshot->pending_obj = NULL;
+        writing = 1;
+
+        pthread_mutex_unlock(&writer_lock);
+
+        int ret = obj ? write_object(snapshot, obj) : snapshot_write(snapshot, data, len);
+
+        /* Snapshots that aren't fatal can be left stale, owner must
+         * be able to tell stale contents apart */
+        if (ret != 0) {
+            if (snapshot->fatal)
+                log_msg_die("%s: database write error\n", snapshot->path);
+            log_msg_at(LOG_LEVEL_WARNING, "%s: write failed, file left stale\n", snapshot->path);
+        }
+        free(data);
+
+        pthread_mutex_lock(&writer_lock);
+        writing = 0;
+        pthread_cond_broadcast(&writer_idle);
+        pthread_mutex_unlock(&writer_lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start thread writing scheduled snapshots
+ *
+ * @return 0 on success
+ */
+int snapshot_start_writer(void)
+{
+    metrics_register(&write_metric, 1);
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, writer_main, NULL);
+    if (ret != 0) {
+        log_msg("pthread_create: %s\n", strerror(ret));
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
+
+/**
+ * Wait until all scheduled snapshots are written
+ */
+void snapshot_flush(void)
+{
+    pthread_mutex_lock(&writer_lock);
+    while (queue || writing)
+        pthread_cond_wait(&writer_idle, &writer_lock);
+    pthread_mutex_unlock(&writer_lock);
+}
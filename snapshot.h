@@ -0,0 +1,33 @@
+#include <stddef.h>
+
+struct buffer;
+
+/**
+ * Database file replaced atomically as a whole
+ */
+struct snapshot {
+    char *path;
+    int fatal;                  /* background write errors end the process */
+
+    /* Turn object given to snapshot_schedule_object() into contents,
+     * called by writer thread. Object is released afterwards. */
+    int (*render)(void *obj, struct buffer *out);
+    void (*release)(void *obj);
+
+    /* guarded by writer lock */
+    char *pending;              /* contents waiting for writer thread */
+    size_t pending_len;
+    void *pending_obj;          /* or object to render them from */
+    int queued;
+    struct snapshot *next;
+};
+
+int snapshot_init(struct snapshot *snapshot, const char *path);
+void snapshot_destroy(struct snapshot *snapshot);
+
+int snapshot_write(struct snapshot *snapshot, const char *data, size_t len);
+int snapshot_schedule(struct snapshot *snapshot, const char *data, size_t len);
+void snapshot_schedule_object(struct snapshot *snapshot, void *obj);
+
+int snapshot_start_writer(void);
+void snapshot_flush(void);
@@ -0,0 +1,198 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing item statistics of tests.
+ *
+ * Only sums are kept, each submission adds to them in time proportional
+ * to the number of options. Reported figures are derived from the sums:
+ * difficulty is the share of correct answers to a question,
+ * discrimination is the point-biserial correlation of answering
+ * it correctly with the total score.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "common.h"
+#include "grade.h"
+#include "selection.h"
+#include "stats.h"
+
+/**
+ * Create empty statistics of test
+ *
+ * @return NULL on error
+ */
+/* allocates memory! */
+struct test_stats *stats_create(json_object *test)
+{
+    json_object *type, *questions, *correct_answers;
+
+    if (json_object_object_get_ex(test, "type", &type) != TRUE ||
+        json_object_object_get_ex(test, "questions", &questions) != TRUE ||
+        json_object_object_get_ex(test, "correctAnswers", &correct_answers) != TRUE ||
+        !json_object_is_type(type, json_type_string) ||
+        !json_object_is_type(questions, json_type_array) ||
+        !json_object_is_type(correct_answers, json_type_array))
+        return NULL;
+
+    struct test_stats *stats = calloc(1, sizeof(*stats));
+    if (!stats) {
+        log_errno("calloc");
+        return NULL;
+    }
+
+    stats->multi = streq(json_object_get_string(type), "multi");
+    stats->nquestions = json_object_array_length(questions);
+    /* the same as in grade_answers() */
+    stats->max_score = json_object_array_length(correct_answers);
+    stats->questions = calloc(stats->nquestions ? stats->nquestions : 1, sizeof(*stats->questions));
+    stats->correct = malloc(stats->nquestions ? stats->nquestions : 1);
+    if (!stats->questions || !stats->correct)
+        goto err;
+
+    for (size_t i = 0; i < stats->nquestions; i++) {
+        struct question_stats *qs = &stats->questions[i];
+        json_object *options;
+
+        if (json_object_object_get_ex(json_object_array_get_idx(questions, i), "options", &options) == TRUE &&
+            json_object_is_type(options, json_type_array))
+            qs->noptions = json_object_array_length(options);
+
+        qs->option_counts = calloc(qs->noptions ? qs->noptions : 1, sizeof(*qs->option_counts));
+        if (!qs->option_counts)
+            goto err;
+    }
+
+    return stats;
+
+err:
+    log_errno("calloc");
+    stats_free(stats);
+    return NULL;
+}
+
+void stats_free(struct test_stats *stats)
+{
+    if (!stats)
+        return;
+
+    for (size_t i = 0; stats->questions && i < stats->nquestions; i++)
+        free(stats->questions[i].option_counts);
+    free(stats->questions);
+    free(stats->correct);
+    free(stats);
+}
+
+static void count_options(struct question_stats *qs, int multi, json_object *answer)
+{
+    if (!multi) {
+        if (json_object_is_type(answer, json_type_int)) {
+            int64_t option = json_object_get_int64(answer);
+            if (option >= 0 && (uint64_t) option < qs->noptions)
+                qs->option_counts[option]++;
+        }
+        return;
+    }
+
+    uint64_t mask;
+    if (selection_mask_stored(answer, qs->noptions, &mask) == 0) {
+        for (size_t i = 0; i < qs->noptions; i++)
+            qs->option_counts[i] += (mask >> i) & 1;
+        return;
+    }
+
+    /* too many options to be packed */
+    for (size_t i = 0; i < qs->noptions; i++) {
+        json_object *selected = json_object_array_get_idx(answer, i);
+        if (json_object_is_type(selected, json_type_boolean) && json_object_get_boolean(selected))
+            qs->option_counts[i]++;
+    }
+}
+
+/**
+ * Add submitted answers to statistics of test
+ *
+ * Answers are scored the same way as by grade_answers(). Caller must
+ * be the only user of statistics.
+ */
+void stats_add(struct test_stats *stats, json_object *test, json_object *answers)
+{
+    json_object *correct_answers;
+    if (json_object_object_get_ex(test, "correctAnswers", &correct_answers) != TRUE ||
+        !json_object_is_type(correct_answers, json_type_array) ||
+        !json_object_is_type(answers, json_type_array))
+        return;
+
+    /* total score is needed before questions are tallied */
+    char *correct = stats->correct;
+    uint64_t score = 0;
+
+    for (size_t i = 0; i < stats->nquestions; i++) {
+        correct[i] = i < stats->max_score &&
+                     grade_question(stats->multi, stats->questions[i].noptions,
+                                    json_object_array_get_idx(correct_answers, i),
+                                    json_object_array_get_idx(answers, i));
+        score += correct[i];
+    }
+
+    for (size_t i = 0; i < stats->nquestions; i++) {
+        struct question_stats *qs = &stats->questions[i];
+        if (correct[i]) {
+            qs->correct++;
+            qs->correct_score_sum += score;
+        }
+        count_options(qs, stats->multi, json_object_array_get_idx(answers, i));
+    }
+
+    stats->submissions++;
+    stats->score_sum += score;
+    stats->score_sq_sum += score * score;
+}
+
+/**
+ * Get figures derived from statistics of test
+ *
+ * Figures that are undefined for the submissions so far are null.
+ */
+/* allocates memory! */
+json_object *stats_to_json(const struct test_stats *stats)
+{
+    json_object *obj = json_object_new_object();
+    json_object *questions = json_object_new_array();
+    double n = stats->submissions;
+    double mean = n > 0 ? stats->score_sum / n : 0;
+    double variance = n > 0 ? stats->score_sq_sum / n - mean * mean : 0;
+    double sd = variance > 0 ? sqrt(variance) : 0;
+
+    json_object_object_add(obj, "submissions", json_object_new_int64(stats->submissions));
+    json_object_object_add(obj, "maxScore", json_object_new_int64(stats->max_score));
+    json_object_object_add(obj, "meanScore", n > 0 ? json_object_new_double(mean) : NULL);
+
+    for (size_t i = 0; i < stats->nquestions; i++) {
+        const struct question_stats *qs = &stats->questions[i];
+        json_object *question = json_object_new_object();
+        json_object *counts = json_object_new_array();
+        double p = n > 0 ? qs->correct / n : 0;
+
+        json_object *discrimination = NULL;
+        if (p > 0 && p < 1 && sd > 0) {
+            double correct_mean = qs->correct_score_sum / (double) qs->correct;
+            discrimination = json_object_new_double((correct_mean - mean) / sd * sqrt(p / (1 - p)));
+        }
+
+        for (size_t j = 0; j < qs->noptions; j++)
+            json_object_array_add(counts, json_object_new_int64(qs->option_counts[j]));
+
+        json_object_object_add(question, "difficulty", n > 0 ? json_object_new_double(p) : NULL);
+        json_object_object_add(question, "discrimination", discrimination);
+        json_object_object_add(question, "optionCounts", counts);
+        json_object_array_add(questions, question);
+    }
+
+    json_object_object_add(obj, "questions", questions);
+    return obj;
+}
@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include <json-c/json.h>
+
+/**
+ * Running tallies of answers to a single question
+ */
+struct question_stats {
+    size_t noptions;
+    uint64_t correct;               /* submissions answering correctly */
+    uint64_t correct_score_sum;     /* sum of their total scores */
+    uint64_t *option_counts;        /* submissions selecting each option */
+};
+
+/**
+ * Running tallies of answers to a test
+ *
+ * Updated by stats_add() for each submission, so figures
+ * derived from them are always current.
+ */
+struct test_stats {
+    int multi;
+    size_t nquestions;
+    size_t max_score;               /* as graded, one point per correct answer */
+    uint64_t submissions;
+    uint64_t score_sum;
+    uint64_t score_sq_sum;
+    struct question_stats *questions;
+    char *correct;                  /* scratch space of stats_add() */
+};
+
+struct test_stats *stats_create(json_object *test);
+void stats_free(struct test_stats *stats);
+void stats_add(struct test_stats *stats, json_object *test, json_object *answers);
+json_object *stats_to_json(const struct test_stats *stats);
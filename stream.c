@@ -0,0 +1,198 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Module implementing streaming serialization of JSON replies.
+ *
+ * Tree is walked with an explicit stack, so serialization can stop
+ * after any value and resume when the peer has taken what was produced
+ * so far. Scalars and keys are still serialized by json-c, which keeps
+ * output the same as json_object_to_json_string_ext() with the same
+ * flags. Only whitespace-free flags are supported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "output.h"
+#include "stream.h"
+
+/* Bytes produced by a single fill */
+#define STREAM_CHUNK    (16 * 1024)
+
+/* Array or object being serialized */
+struct stream_frame {
+    json_object *obj;
+    int is_array;
+    int first;                          /* no member was written yet */
+    size_t idx;                         /* of next array element */
+    size_t len;
+    struct json_object_iterator it;     /* at next object member */
+    struct json_object_iterator end;
+};
+
+struct json_stream {
+    struct output_source source;
+    json_object *root;
+    int flags;
+    int started;
+    struct stream_frame *stack;
+    size_t depth;
+    size_t size;
+};
+
+static int push_frame(struct json_stream *js, json_object *obj)
+{
+    if (js->depth == js->size) {
+        size_t size = js->size ? js->size * 2 : 16;
+        struct stream_frame *stack = realloc(js->stack, size * sizeof(*stack));
+        if (!stack) {
+            log_errno("realloc");
+            return -1;
+        }
+        js->stack = stack;
+        js->size = size;
+    }
+
+    struct stream_frame *f = &js->stack[js->depth++];
+    f->obj = obj;
+    f->is_array = json_object_is_type(obj, json_type_array);
+    f->first = 1;
+    if (f->is_array) {
+        f->idx = 0;
+        f->len = json_object_array_length(obj);
+    } else {
+        f->it = json_object_iter_begin(obj);
+        f->end = json_object_iter_end(obj);
+    }
+
+    return 0;
+}
+
+/**
+ * Write scalar value or opening bracket of container
+ */
+static int write_value(struct json_stream *js, json_object *obj, struct buffer *buf)
+{
+    if (json_object_is_type(obj, json_type_array)) {
+        if (push_frame(js, obj) != 0)
+            return -1;
+        return buffer_puts(buf, "[");
+    }
+    if (json_object_is_type(obj, json_type_object)) {
+        if (push_frame(js, obj) != 0)
+            return -1;
+        return buffer_puts(buf, "{");
+    }
+    if (!obj)
+        return buffer_puts(buf, "null");
+
+    return buffer_puts(buf, json_object_to_json_string_ext(obj, js->flags));
+}
+
+static int write_key(struct json_stream *js, const char *key, struct buffer *buf)
+{
+    json_object *string = json_object_new_string(key);
+    if (!string)
+        return -1;
+
+    int ret = buffer_puts(buf, json_object_to_json_string_ext(string, js->flags));
+    json_object_put(string);
+    if (ret != 0)
+        return -1;
+
+    return buffer_puts(buf, ":");
+}
+
+/**
+ * Write next member of innermost container, or close it
+ */
+static int write_next(struct json_stream *js, struct buffer *buf)
+{
+    struct stream_frame *f = &js->stack[js->depth - 1];
+
+    if (f->is_array ? f->idx == f->len : json_object_iter_equal(&f->it, &f->end)) {
+        js->depth--;
+        return buffer_puts(buf, f->is_array ? "]" : "}");
+    }
+
+    if (!f->first && buffer_puts(buf, ",") != 0)
+        return -1;
+    f->first = 0;
+
+    json_object *value;
+    if (f->is_array) {
+        value = json_object_array_get_idx(f->obj, f->idx++);
+    } else {
+        if (write_key(js, json_object_iter_peek_name(&f->it), buf) != 0)
+            return -1;
+        value = json_object_iter_peek_value(&f->it);
+        json_object_iter_next(&f->it);
+    }
+
+    /* f may be moved by push_frame() */
+    return write_value(js, value, buf);
+}
+
+static int json_stream_fill(struct output_source *src, struct buffer *buf)
+{
+    struct json_stream *js = container_of(src, struct json_stream, source);
+    size_t limit = buffer_length(buf) + STREAM_CHUNK;
+
+    if (!js->started) {
+        js->started = 1;
+        if (write_value(js, js->root, buf) != 0)
+            return -1;
+    }
+
+    while (js->depth > 0 && buffer_length(buf) < limit)
+        if (write_next(js, buf) != 0)
+            return -1;
+
+    if (js->depth > 0)
+        return 0;
+
+    return buffer_puts(buf, "\r\n") == 0 ? 1 : -1;
+}
+
+static void json_stream_free(struct output_source *src)
+{
+    struct json_stream *js = container_of(src, struct json_stream, source);
+
+    json_object_put(js->root);
+    free(js->stack);
+    free(js);
+}
+
+/**
+ * Create source serializing JSON object as a line of reply
+ *
+ * Object must not be shared with other threads. Source takes
+ * ownership of it on success.
+ *
+ * @param flags json-c serialization flags
+ *
+ * @return NULL on error
+ */
+struct output_source *json_stream_new(json_object *obj, int flags)
+{
+    struct json_stream *js = malloc(sizeof(*js));
+    if (!js) {
+        log_errno("malloc");
+        return NULL;
+    }
+
+    js->source.fill = json_stream_fill;
+    js->source.free = json_stream_free;
+    js->root = obj;
+    js->flags = flags;
+    js->started = 0;
+    js->stack = NULL;
+    js->depth = 0;
+    js->size = 0;
+
+    return &js->source;
+}
@@ -0,0 +1,5 @@
+#include <json-c/json.h>
+
+struct output_source;
+
+struct output_source *json_stream_new(json_object *obj, int flags);
@@ -0,0 +1,61 @@
+/**
+ * @file
+ * @author Piotr Martycz <pmartycz@gmail.com>
+ *
+ * @section DESCRIPTION
+ * Checks of validation of answers submitted to tests.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <json-c/json.h>
+
+#include "../common.h"
+#include "../db.h"
+
+static const char *single_test =
+    "{ \"type\": \"single\", \"questions\": ["
+    "    { \"text\": \"q1\", \"options\": [ \"a\", \"b\" ] },"
+    "    { \"text\": \"q2\", \"options\": [ \"a\", \"b\", \"c\" ] } ] }";
+
+static const char *multi_test =
+    "{ \"type\": \"multi\", \"questions\": ["
+    "    { \"text\": \"q1\", \"options\": [ \"a\", \"b\" ] } ] }";
+
+static int failures;
+
+static void check(const char *test_text, const char *answers_text, int expected)
+{
+    json_object *test = json_tokener_parse(test_text);
+    json_object *answers = json_tokener_parse(answers_text);
+
+    if (answers_to_test_are_valid(test, answers) != expected) {
+        fprintf(stderr, "FAIL: %s should be %s\n", answers_text, expected ? "valid" : "invalid");
+        failures++;
+    }
+
+    json_object_put(test);
+    json_object_put(answers);
+}
+
+int main(void)
+{
+    check(single_test, "[ 1, 2 ]", 1);
+    check(single_test, "[ 0, 0 ]", 1);
+    /* option index out of range */
+    check(single_test, "[ 2, 0 ]", 0);
+    check(single_test, "[ 0, 3 ]", 0);
+    check(single_test, "[ -1, 0 ]", 0);
+    check(single_test, "[ \"0\", 0 ]", 0);
+    check(single_test, "[ 0 ]", 0);
+
+    check(multi_test, "[ [ true, false ] ]", 1);
+    check(multi_test, "[ [ true ] ]", 0);
+    check(multi_test, "[ 1 ]", 0);
+
+    if (failures)
+        return EXIT_FAILURE;
+
+    printf("answers_test: OK\n");
+    return EXIT_SUCCESS;
+}